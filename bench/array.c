@@ -0,0 +1,435 @@
+/*
+ * libniftyprefs - lightweight modelless preferences management library
+ * Copyright (C) 2006-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/*
+ * micro-benchmarks for the NftArray engine
+ *
+ * usage: array-bench [size ...]
+ *
+ * Prints one tab-separated line per benchmark:
+ *   <benchmark> <mode> <pattern> <size> <ops> <ns_per_op> <allocs>
+ *
+ * - mode is "flat" (nft_array_init()) or "stable" (nft_array_init_stable())
+ * - allocs is the amount of alloc/realloc calls the array did while the
+ *   benchmark ran
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <niftylog.h>
+#include <niftyprefs.h>
+
+
+
+/** default array sizes to benchmark */
+static const size_t _default_sizes[] = {
+        10, 100, 1000, 10000, 100000, 1000000, 10000000
+};
+
+/** minimum amount of operations per benchmark */
+#define MIN_OPS         1000000
+
+/** maximum amount of elements visited by linear searches per benchmark */
+#define MAX_SCANNED     100000000
+
+
+/** amount of alloc/realloc calls since last reset */
+static size_t _allocs;
+
+
+
+/** counting allocator */
+static void *_bench_alloc(size_t size, void *userptr)
+{
+        _allocs++;
+        return malloc(size);
+}
+
+
+/** counting allocator */
+static void *_bench_realloc(void *ptr, size_t size, void *userptr)
+{
+        _allocs++;
+        return realloc(ptr, size);
+}
+
+
+/** counting allocator */
+static void _bench_free(void *ptr, void *userptr)
+{
+        free(ptr);
+}
+
+
+/** allocator used for all benchmarked arrays */
+static const NftAllocator _allocator = {
+        .alloc = _bench_alloc,
+        .realloc = _bench_realloc,
+        .free = _bench_free,
+        .userptr = NULL,
+};
+
+
+/** current monotonic time in nanoseconds */
+static double _now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (double) t.tv_sec * 1000000000.0 + (double) t.tv_nsec;
+}
+
+
+/** small & fast pseudo random number generator (xorshift64) */
+static size_t _random(uint64_t * state)
+{
+        uint64_t x = *state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        *state = x;
+        return (size_t) x;
+}
+
+
+/** print one result */
+static void _report(const char *benchmark, bool stable, const char *pattern,
+                    size_t size, size_t ops, double start, size_t allocs)
+{
+        double ns = _now() - start;
+
+        printf("%s\t%s\t%s\t%zu\t%zu\t%.2f\t%zu\n",
+               benchmark, stable ? "stable" : "flat", pattern,
+               size, ops, ops ? ns / (double) ops : 0.0, allocs);
+}
+
+
+/** initialize an empty array */
+static NftResult _init(NftArray * a, bool stable)
+{
+        if(!(stable ? nft_array_init_stable(a, sizeof(size_t)) :
+             nft_array_init(a, sizeof(size_t))))
+                return NFT_FAILURE;
+
+        nft_array_set_name(a, "BenchArray");
+
+        return nft_array_set_allocator(a, &_allocator);
+}
+
+
+/** fill array with size elements (element value = slot) */
+static NftResult _fill(NftArray * a, size_t size, bool bulk)
+{
+        if(bulk)
+        {
+                NftArraySlot *slots;
+                if(!(slots = malloc(size * sizeof(NftArraySlot))))
+                        return NFT_FAILURE;
+
+                if(!nft_array_slot_alloc_n(a, size, slots))
+                {
+                        free(slots);
+                        return NFT_FAILURE;
+                }
+
+                size_t i;
+                for(i = 0; i < size; i++)
+                        *(size_t *) nft_array_get_element_unchecked(a,
+                                                                    slots
+                                                                    [i]) =
+                                slots[i];
+
+                free(slots);
+                return NFT_SUCCESS;
+        }
+
+        size_t i;
+        for(i = 0; i < size; i++)
+        {
+                NftArraySlot s;
+                if(!nft_array_slot_alloc(a, &s))
+                        return NFT_FAILURE;
+
+                *(size_t *) nft_array_get_element_unchecked(a, s) = s;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/** finder for nft_array_find_slot() */
+static bool _finder(void *element, void *criterion, void *userptr)
+{
+        return *(size_t *) element == *(size_t *) criterion;
+}
+
+
+/** foreach callback */
+static bool _summer(void *element, void *userptr)
+{
+        *(size_t *) userptr += *(size_t *) element;
+        return true;
+}
+
+
+/** slot_alloc: fill an empty array one slot at a time or in bulk */
+static NftResult _bench_alloc_fill(size_t size, bool stable, bool bulk)
+{
+        NftArray a;
+        if(!_init(&a, stable))
+                return NFT_FAILURE;
+
+        _allocs = 0;
+        double start = _now();
+        NftResult r = _fill(&a, size, bulk);
+        if(r)
+                _report("slot_alloc", stable, bulk ? "bulk" : "sequential",
+                        size, size, start, _allocs);
+
+        nft_array_deinit(&a);
+        return r;
+}
+
+
+/** slot_alloc/slot_free: churn a full array */
+static NftResult _bench_churn(size_t size, bool stable, bool random)
+{
+        NftArray a;
+        if(!_init(&a, stable) || !_fill(&a, size, false))
+        {
+                nft_array_deinit(&a);
+                return NFT_FAILURE;
+        }
+
+        uint64_t state = 88172645463325252ULL;
+        size_t ops = MIN_OPS;
+
+        _allocs = 0;
+        double start = _now();
+        size_t i;
+        for(i = 0; i < ops; i++)
+        {
+                NftArraySlot s = random ? _random(&state) % size : size - 1;
+                nft_array_slot_free(&a, s);
+                if(!nft_array_slot_alloc(&a, &s))
+                {
+                        nft_array_deinit(&a);
+                        return NFT_FAILURE;
+                }
+        }
+        _report("slot_churn", stable, random ? "random" : "lifo",
+                size, ops, start, _allocs);
+
+        nft_array_deinit(&a);
+        return NFT_SUCCESS;
+}
+
+
+/** get_element: sequential & random access */
+static NftResult _bench_get(size_t size, bool stable, bool random)
+{
+        NftArray a;
+        if(!_init(&a, stable) || !_fill(&a, size, false))
+        {
+                nft_array_deinit(&a);
+                return NFT_FAILURE;
+        }
+
+        uint64_t state = 88172645463325252ULL;
+        size_t ops = size > MIN_OPS ? size : MIN_OPS;
+        volatile size_t sum = 0;
+
+        _allocs = 0;
+        double start = _now();
+        size_t i;
+        for(i = 0; i < ops; i++)
+        {
+                NftArraySlot s = random ? _random(&state) % size : i % size;
+                sum += *(size_t *) nft_array_get_element(&a, s);
+        }
+        _report("get_element", stable, random ? "random" : "sequential",
+                size, ops, start, _allocs);
+
+        nft_array_deinit(&a);
+        return NFT_SUCCESS;
+}
+
+
+/** find_slot: linear search for random elements */
+static NftResult _bench_find(size_t size, bool stable)
+{
+        NftArray a;
+        if(!_init(&a, stable) || !_fill(&a, size, false))
+        {
+                nft_array_deinit(&a);
+                return NFT_FAILURE;
+        }
+
+        uint64_t state = 88172645463325252ULL;
+        size_t ops = MAX_SCANNED / size;
+        if(ops > MIN_OPS)
+                ops = MIN_OPS;
+        if(ops < 1)
+                ops = 1;
+
+        _allocs = 0;
+        double start = _now();
+        size_t i;
+        for(i = 0; i < ops; i++)
+        {
+                size_t wanted = _random(&state) % size;
+                NftArraySlot s;
+                if(!nft_array_find_slot(&a, &s, _finder, &wanted, NULL))
+                {
+                        nft_array_deinit(&a);
+                        return NFT_FAILURE;
+                }
+        }
+        _report("find_slot", stable, "random", size, ops, start, _allocs);
+
+        nft_array_deinit(&a);
+        return NFT_SUCCESS;
+}
+
+
+/** foreach_element: visit all elements of a full or half-empty array
+    (ns_per_op is per visited element) */
+static NftResult _bench_foreach(size_t size, bool stable, bool sparse)
+{
+        NftArray a;
+        if(!_init(&a, stable) || !_fill(&a, size, false))
+        {
+                nft_array_deinit(&a);
+                return NFT_FAILURE;
+        }
+
+        /* free every other slot */
+        size_t count = size;
+        if(sparse)
+        {
+                size_t s;
+                for(s = 0; s < size; s += 2)
+                        nft_array_slot_free(&a, s);
+                count = nft_array_get_elementcount(&a);
+        }
+
+        size_t rounds = count ? (MIN_OPS + count - 1) / count : 1;
+        size_t sum = 0;
+
+        _allocs = 0;
+        double start = _now();
+        size_t i;
+        for(i = 0; i < rounds; i++)
+                nft_array_foreach_element(&a, _summer, &sum);
+        _report("foreach_element", stable, sparse ? "sparse" : "dense",
+                size, rounds * count, start, _allocs);
+
+        nft_array_deinit(&a);
+        return sum || !count ? NFT_SUCCESS : NFT_FAILURE;
+}
+
+
+/** run all benchmarks for one array size */
+static NftResult _bench_size(size_t size, bool stable)
+{
+        return _bench_alloc_fill(size, stable, false) &&
+                _bench_alloc_fill(size, stable, true) &&
+                _bench_churn(size, stable, false) &&
+                _bench_churn(size, stable, true) &&
+                _bench_get(size, stable, false) &&
+                _bench_get(size, stable, true) &&
+                _bench_find(size, stable) &&
+                _bench_foreach(size, stable, false) &&
+                _bench_foreach(size, stable, true);
+}
+
+
+/** NftArray micro-benchmarks */
+int main(int argc, char *argv[])
+{
+        /* do preliminary version checks */
+        if(!NFT_PREFS_CHECK_VERSION)
+                return EXIT_FAILURE;
+
+        /* collect sizes */
+        size_t sizes[64];
+        size_t n = 0;
+        int i;
+        for(i = 1; i < argc && n < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+                char *end;
+                unsigned long long size = strtoull(argv[i], &end, 10);
+                if(*end || size == 0 || size > NFT_ARRAY_HANDLE_MAX_SLOT)
+                {
+                        fprintf(stderr, "usage: %s [size ...]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+                sizes[n++] = (size_t) size;
+        }
+
+        if(n == 0)
+        {
+                for(n = 0; n < sizeof(_default_sizes) / sizeof(_default_sizes[0]);
+                    n++)
+                        sizes[n] = _default_sizes[n];
+        }
+
+        printf("# benchmark\tmode\tpattern\tsize\tops\tns_per_op\tallocs\n");
+
+        size_t s;
+        for(s = 0; s < n; s++)
+        {
+                if(!_bench_size(sizes[s], false) ||
+                   !_bench_size(sizes[s], true))
+                {
+                        NFT_LOG(L_ERROR, "benchmark failed for size %zu",
+                                sizes[s]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        return EXIT_SUCCESS;
+}
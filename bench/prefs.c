@@ -0,0 +1,297 @@
+/*
+ * libniftyprefs - lightweight modelless preferences management library
+ * Copyright (C) 2006-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/*
+ * benchmark for loading preference trees with many classes
+ *
+ * usage: prefs-bench [classes ...]
+ *
+ * Prints one tab-separated line per benchmark:
+ *   <benchmark> <classes> <nodes> <ns_per_node>
+ *
+ * - "from_buffer" parses a tree of version 0 into a version 1 context, so
+ *   every node gets checked for updaters
+ * - "obj_from_node" creates objects from all nodes of the tree
+ * - "register" registers all classes one by one, "register_table" at once
+ *   using nft_prefs_class_register_table() (<nodes> is the amount of
+ *   classes here)
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <niftylog.h>
+#include <niftyprefs.h>
+
+
+
+/** default amounts of classes to benchmark */
+static const size_t _default_classes[] = {
+        1, 10, 100, 1000
+};
+
+/** amount of child nodes of the benchmarked tree */
+#define NODES           100000
+
+/** name of toplevel class */
+#define ROOT_NAME       "root"
+
+
+
+/** current monotonic time in nanoseconds */
+static double _now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (double) t.tv_sec * 1000000000.0 + (double) t.tv_nsec;
+}
+
+
+/** updater that doesn't change anything */
+static NftResult _updater(NftPrefsNode * node, unsigned int version,
+                          void *userptr)
+{
+        return NFT_SUCCESS;
+}
+
+
+/** toObj of child classes */
+static NftResult _child_from_prefs(NftPrefs * p, void **newObj,
+                                   NftPrefsNode * node, void *userptr)
+{
+        (*(size_t *) userptr)++;
+        *newObj = userptr;
+        return NFT_SUCCESS;
+}
+
+
+/** toObj of toplevel class: create objects of all children */
+static NftResult _root_from_prefs(NftPrefs * p, void **newObj,
+                                  NftPrefsNode * node, void *userptr)
+{
+        NftPrefsNode *child;
+        for(child = nft_prefs_node_get_first_child(node);
+            child; child = nft_prefs_node_get_next(child))
+        {
+                if(!nft_prefs_obj_from_node(p, child, userptr))
+                        return NFT_FAILURE;
+        }
+
+        *newObj = userptr;
+        return NFT_SUCCESS;
+}
+
+
+/** generate XML of a tree with NODES children spread over all classes */
+static char *_tree(size_t classes, size_t *length)
+{
+        size_t size = 64 + NODES * 32;
+        char *xml;
+        if(!(xml = malloc(size)))
+                return NULL;
+
+        size_t l = snprintf(xml, size, "<" ROOT_NAME " version=\"0\">");
+        size_t i;
+        for(i = 0; i < NODES; i++)
+                l += snprintf(&xml[l], size - l, "<class%zu/>", i % classes);
+        l += snprintf(&xml[l], size - l, "</" ROOT_NAME ">");
+
+        *length = l;
+        return xml;
+}
+
+
+/** register all classes using nft_prefs_class_register_table() */
+static NftResult _bench_table(size_t classes)
+{
+        NftResult r = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(1)))
+                return NFT_FAILURE;
+
+        char (*names)[NFT_PREFS_MAX_CLASSNAME] = NULL;
+        NftPrefsClassDesc *table = NULL;
+        if(!(names = malloc(classes * sizeof(*names))) ||
+           !(table = calloc(classes, sizeof(*table))))
+                goto _bt_exit;
+
+        static const NftPrefsUpdaterDesc updater = {.updater = _updater };
+        size_t i;
+        for(i = 0; i < classes; i++)
+        {
+                snprintf(names[i], sizeof(names[i]), "class%zu", i);
+                table[i].name = names[i];
+                table[i].toObj = _child_from_prefs;
+                table[i].updaters = &updater;
+                table[i].updaterCount = 1;
+        }
+
+        double start = _now();
+        if(!nft_prefs_class_register_table(p, table, classes))
+                goto _bt_exit;
+        printf("register_table\t%zu\t%zu\t%.2f\n", classes, classes,
+               (_now() - start) / classes);
+
+        r = NFT_SUCCESS;
+
+_bt_exit:
+        free(table);
+        free(names);
+        nft_prefs_deinit(p);
+        return r;
+}
+
+
+/** run benchmarks for one amount of classes */
+static NftResult _bench_classes(size_t classes)
+{
+        NftResult r = NFT_FAILURE;
+        char *xml = NULL;
+        NftPrefsNode *node = NULL;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(1)))
+                return NFT_FAILURE;
+
+        /* register classes (last one registered is found last by a
+         * linear search) */
+        if(!nft_prefs_class_register(p, ROOT_NAME, _root_from_prefs, NULL))
+                goto _bc_exit;
+
+        size_t i;
+        double start = _now();
+        for(i = 0; i < classes; i++)
+        {
+                char name[NFT_PREFS_MAX_CLASSNAME];
+                snprintf(name, sizeof(name), "class%zu", i);
+                if(!nft_prefs_class_register(p, name, _child_from_prefs, NULL) ||
+                   !nft_prefs_updater_register(p, _updater, name, 0, NULL))
+                        goto _bc_exit;
+        }
+        printf("register\t%zu\t%zu\t%.2f\n", classes, classes,
+               (_now() - start) / classes);
+
+        size_t length;
+        if(!(xml = _tree(classes, &length)))
+                goto _bc_exit;
+
+        /* parse & update */
+        start = _now();
+        if(!(node = nft_prefs_node_from_buffer(p, xml, length)))
+                goto _bc_exit;
+        printf("from_buffer\t%zu\t%d\t%.2f\n", classes, NODES,
+               (_now() - start) / NODES);
+
+        /* create objects */
+        size_t count = 0;
+        start = _now();
+        if(!nft_prefs_obj_from_node(p, node, &count) || count != NODES)
+                goto _bc_exit;
+        printf("obj_from_node\t%zu\t%d\t%.2f\n", classes, NODES,
+               (_now() - start) / NODES);
+
+        r = NFT_SUCCESS;
+
+_bc_exit:
+        if(node)
+                nft_prefs_node_free(node);
+        free(xml);
+        nft_prefs_deinit(p);
+        return r;
+}
+
+
+/** class registry benchmarks */
+int main(int argc, char *argv[])
+{
+        /* do preliminary version checks */
+        if(!NFT_PREFS_CHECK_VERSION)
+                return EXIT_FAILURE;
+
+        /* updating logs every node */
+        nft_log_level_set(L_WARNING);
+
+        /* collect amounts of classes */
+        size_t classes[64];
+        size_t n = 0;
+        int i;
+        for(i = 1; i < argc && n < sizeof(classes) / sizeof(classes[0]); i++)
+        {
+                char *end;
+                unsigned long c = strtoul(argv[i], &end, 10);
+                if(*end || c == 0)
+                {
+                        fprintf(stderr, "usage: %s [classes ...]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+                classes[n++] = (size_t) c;
+        }
+
+        if(n == 0)
+        {
+                for(n = 0;
+                    n < sizeof(_default_classes) / sizeof(_default_classes[0]);
+                    n++)
+                        classes[n] = _default_classes[n];
+        }
+
+        printf("# benchmark\tclasses\tnodes\tns_per_node\n");
+
+        size_t c;
+        for(c = 0; c < n; c++)
+        {
+                if(!_bench_classes(classes[c]) || !_bench_table(classes[c]))
+                {
+                        NFT_LOG(L_ERROR, "benchmark failed for %zu classes",
+                                classes[c]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -59,6 +59,7 @@
 
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include "nifty-primitives.h"
@@ -68,20 +69,64 @@
 /** slot to define position inside array */
 typedef size_t                  NftArraySlot;
 
+/** slot of an array plus generation of that slot (s. nft_array_slot_get_handle()) */
+typedef uint64_t                NftArrayHandle;
+
 /** descriptor for one array element */
 typedef struct _NftElement      NftElement;
 
+/** key index of an array (s. nft_array_index_enable()) */
+typedef struct _NftArrayIndex   NftArrayIndex;
+
+/** function that returns the key of an array element */
+typedef const void             *(NftArrayKeyFunc) (void *element);
+
+/** function that hashes a key returned by a NftArrayKeyFunc */
+typedef size_t                  (NftArrayHashFunc) (const void *key);
+
+/** function that returns true if two keys are equal */
+typedef bool                    (NftArrayKeyEqualFunc) (const void *a, const void *b);
+
+/** function that gets notified when nft_array_compact() moved an element from one slot to another */
+typedef void                    (NftArrayRemapFunc) (void *element, NftArraySlot from, NftArraySlot to, void *userptr);
 
-/** increase array by this amount of element entries if space runs out */
+
+/** increase array at least by this amount of element entries if space runs out (arrays grow geometrically) */
 #define NFT_ARRAY_DEFAULT_INC 64
+/** stable arrays allocate elements in chunks of 2^NFT_ARRAY_CHUNK_SHIFT elements */
+#define NFT_ARRAY_CHUNK_SHIFT 6
+/** amount of elements in one chunk of a stable array */
+#define NFT_ARRAY_CHUNK_SIZE (1 << NFT_ARRAY_CHUNK_SHIFT)
+/** amount of slots described by one word of NftArray->occupied */
+#define NFT_ARRAY_WORD_BITS 64
+/** marks the end of the free-slot list */
+#define NFT_ARRAY_SLOT_INVALID ((NftArraySlot) -1)
+/** handle that never refers to an element */
+#define NFT_ARRAY_HANDLE_INVALID ((NftArrayHandle) -1)
+/** largest slot that can be stored in an NftArrayHandle */
+#define NFT_ARRAY_HANDLE_MAX_SLOT ((NftArraySlot) 0xfffffffe)
+/** get slot from an NftArrayHandle */
+#define NFT_ARRAY_HANDLE_SLOT(h) ((NftArraySlot) ((h) & 0xffffffff))
 /** maximum length of NftArray->name */
 #define NFT_ARRAY_NAME_MAXLEN 64
 
+/** storage modes of an NftArray */
+typedef enum
+{
+        /** elements are stored in chunks that never move instead of one buffer that moves when the array grows */
+        NFT_ARRAY_STABLE = (1 << 0),
+        /** slots can be allocated & freed by multiple threads at once (s. nft_array_init_concurrent()) */
+        NFT_ARRAY_CONCURRENT = (1 << 1),
+} NftArrayFlags;
+
+
 /** descriptor to handle arbitrary pointer arrays */
 typedef struct _NftArray
 {
         /** optional variable to differ array types */
         int                             type;
+        /** NftArrayFlags of this array */
+        NftArrayFlags                   flags;
         /** optional printable name of this array */
         char                            name[NFT_ARRAY_NAME_MAXLEN];
         /** size of one element in bytes */
@@ -92,14 +137,33 @@ typedef struct _NftArray
         size_t                          arraysize;
         /** NftElement array with pointers to elements inside buffer */
         NftElement                     *elements;
+        /** occupancy bitmap - bit (s % 64) of word (s / 64) is set if slot s is allocated */
+        uint64_t                       *occupied;
         /** buffer for actual elements. large enough to hold space*elementsize bytes */
         char                           *buffer;
+        /** NFT_ARRAY_STABLE only: table of (arraysize / NFT_ARRAY_CHUNK_SIZE) chunks holding the actual elements instead of buffer */
+        char                          **chunks;
+        /** amount of slots that have been handed out at least once (slots >= used are untouched) */
+        size_t                          used;
+        /** generation of descriptors added when the array grows (above the generation of every descriptor released by shrinking, s. NftArrayHandle) */
+        uint32_t                        generation;
+        /** most recently freed slot (head of free-slot list) or NFT_ARRAY_SLOT_INVALID */
+        NftArraySlot                    freelist;
+        /** NFT_ARRAY_CONCURRENT only: head of free-slot list (slot in lower 32 bits, ABA counter in upper 32 bits) */
+        uint64_t                        freehead;
+        /** optional key index (s. nft_array_index_enable()) or NULL */
+        NftArrayIndex                  *index;
+        /** allocator used for all memory of this array (NULL for malloc()/free()) */
+        const NftAllocator             *allocator;
 } NftArray;
 
 
 
 NftResult                       nft_array_init(NftArray * a, size_t elementSize);
+NftResult                       nft_array_init_stable(NftArray * a, size_t elementSize);
+NftResult                       nft_array_init_concurrent(NftArray * a, size_t elementSize, size_t maxElements);
 void                            nft_array_deinit(NftArray * a);
+NftResult                       nft_array_set_allocator(NftArray * a, const NftAllocator * allocator);
 
 void                            nft_array_set_name(NftArray * a, const char *name);
 void                            nft_array_set_type(NftArray * a, int type);
@@ -109,13 +173,203 @@ ssize_t                         nft_array_get_elementcount(NftArray * a);
 const char                     *nft_array_get_name(NftArray * a);
 int                             nft_array_get_type(NftArray * a);
 
+NftResult                       nft_array_reserve(NftArray * a, size_t n);
+NftResult                       nft_array_shrink_to_fit(NftArray * a);
+NftResult                       nft_array_compact(NftArray * a, NftArrayRemapFunc * remap, void *userptr);
+
 NftResult                       nft_array_slot_alloc(NftArray * a, NftArraySlot * s);
+NftResult                       nft_array_slot_alloc_n(NftArray * a, size_t n, NftArraySlot * slots);
 void                            nft_array_slot_free(NftArray * a, NftArraySlot s);
+void                            nft_array_clear(NftArray * a);
 void                           *nft_array_get_element(NftArray * a, NftArraySlot s);
 
+NftArrayHandle                  nft_array_slot_get_handle(NftArray * a, NftArraySlot s);
+bool                            nft_array_handle_is_valid(NftArray * a, NftArrayHandle h);
+void                           *nft_array_handle_get_element(NftArray * a, NftArrayHandle h);
+
 NftResult                       nft_array_find_slot(NftArray * a, NftArraySlot * s, bool(*finder) (void *element, void *criterion, void *userptr), void *criterion, void *userptr);
 NftResult                       nft_array_foreach_element(NftArray * a, bool(*foreach) (void *element, void *userptr), void *userptr);
 
+NftResult                       nft_array_index_enable(NftArray * a, NftArrayKeyFunc * key, NftArrayHashFunc * hash, NftArrayKeyEqualFunc * equal);
+void                            nft_array_index_disable(NftArray * a);
+NftResult                       nft_array_find_by_key(NftArray * a, NftArraySlot * s, const void *key);
+size_t                          nft_array_hash_string(const void *key);
+bool                            nft_array_key_equal_string(const void *a, const void *b);
+
+
+
+/** load a value that may be changed by another thread (s. NFT_ARRAY_CONCURRENT) */
+#ifdef __GNUC__
+#define _NFT_ARRAY_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#else
+#define _NFT_ARRAY_LOAD(p) (*(p))
+#endif
+
+
+/* this header can't see config.h (HAVE_BUILTIN_CTZLL), so ask the compiler */
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_ctzll)
+#define _NFT_ARRAY_HAVE_CTZLL 1
+#endif
+#elif defined(__GNUC__)
+#define _NFT_ARRAY_HAVE_CTZLL 1
+#endif
+
+
+/** index of lowest set bit in w (w must not be 0) */
+static inline unsigned int _nft_array_ctz(uint64_t w)
+{
+#ifdef _NFT_ARRAY_HAVE_CTZLL
+        return __builtin_ctzll(w);
+#else
+        unsigned int n = 0;
+        while(!(w & 1))
+        {
+                w >>= 1;
+                n++;
+        }
+        return n;
+#endif
+}
+
+
+/**
+ * get element of a slot without any checks. Use this only for slots that
+ * are known to be allocated (e.g. during NFT_ARRAY_FOREACH)
+ *
+ * @param a NftArray descriptor
+ * @param s allocated NftArraySlot
+ * @result pointer to element
+ */
+static inline void *nft_array_get_element_unchecked(NftArray * a, NftArraySlot s)
+{
+        if(a->flags & NFT_ARRAY_STABLE)
+                return &a->chunks[s >> NFT_ARRAY_CHUNK_SHIFT][a->elementsize * (s & (NFT_ARRAY_CHUNK_SIZE - 1))];
+
+        return &a->buffer[a->elementsize * s];
+}
+
+
+/**
+ * get element of a handle without any checks. Use this only for handles
+ * that are known to be valid (s. nft_array_handle_is_valid())
+ *
+ * @param a NftArray descriptor
+ * @param h valid NftArrayHandle
+ * @result pointer to element
+ */
+static inline void *nft_array_handle_get_element_unchecked(NftArray * a, NftArrayHandle h)
+{
+        return nft_array_get_element_unchecked(a, NFT_ARRAY_HANDLE_SLOT(h));
+}
+
+
+/**
+ * find the first allocated slot at or behind a certain slot
+ *
+ * @param a NftArray descriptor
+ * @param s first slot to check
+ * @result first allocated slot >= s or NFT_ARRAY_SLOT_INVALID
+ */
+static inline NftArraySlot nft_array_slot_next(NftArray * a, NftArraySlot s)
+{
+        const uint64_t *o = a->occupied;
+        size_t w = s / NFT_ARRAY_WORD_BITS;
+        uint64_t mask = ~((uint64_t) 0) << (s % NFT_ARRAY_WORD_BITS);
+        uint64_t bits;
+        size_t words;
+
+        /* only concurrent arrays change while we look, all others get plain loads */
+        if(a->flags & NFT_ARRAY_CONCURRENT)
+        {
+                words = (_NFT_ARRAY_LOAD(&a->used) + NFT_ARRAY_WORD_BITS - 1) / NFT_ARRAY_WORD_BITS;
+                if(w >= words)
+                        return NFT_ARRAY_SLOT_INVALID;
+
+                for(bits = _NFT_ARRAY_LOAD(&o[w]) & mask; !bits; bits = _NFT_ARRAY_LOAD(&o[w]))
+                {
+                        if(++w >= words)
+                                return NFT_ARRAY_SLOT_INVALID;
+                }
+
+                return w * NFT_ARRAY_WORD_BITS + _nft_array_ctz(bits);
+        }
+
+        words = (a->used + NFT_ARRAY_WORD_BITS - 1) / NFT_ARRAY_WORD_BITS;
+        if(w >= words)
+                return NFT_ARRAY_SLOT_INVALID;
+
+        /* ignore slots below s */
+        bits = o[w] & mask;
+
+        while(!bits)
+        {
+                w++;
+
+                /* skip runs of empty words, 256 slots at a time */
+                while(w + 4 <= words && !(o[w] | o[w + 1] | o[w + 2] | o[w + 3]))
+                        w += 4;
+
+                if(w >= words)
+                        return NFT_ARRAY_SLOT_INVALID;
+
+                bits = o[w];
+        }
+
+        return w * NFT_ARRAY_WORD_BITS + _nft_array_ctz(bits);
+}
+
+
+/**
+ * start iterating over all allocated slots of an array
+ *
+ * @param a NftArray descriptor
+ * @result first allocated slot or NFT_ARRAY_SLOT_INVALID if array is empty
+ */
+static inline NftArraySlot nft_array_iter_begin(NftArray * a)
+{
+        return nft_array_slot_next(a, 0);
+}
+
+
+/**
+ * continue iterating over all allocated slots of an array. The current slot
+ * may be freed before calling this.
+ *
+ * @param a NftArray descriptor
+ * @param s current slot
+ * @result next allocated slot or NFT_ARRAY_SLOT_INVALID if there are no more
+ */
+static inline NftArraySlot nft_array_iter_next(NftArray * a, NftArraySlot s)
+{
+        return nft_array_slot_next(a, s + 1);
+}
+
+
+/**
+ * walk all allocated slots of an array in ascending order
+ *
+ * @param a NftArray descriptor
+ * @param s NftArraySlot variable that holds the current slot
+ * @param element pointer variable that holds the current element
+ *
+ * e.g.:
+ * @code
+ * NftArraySlot s;
+ * int *e;
+ * NFT_ARRAY_FOREACH(&a, s, e)
+ * {
+ *         printf("%d\n", *e);
+ * }
+ * @endcode
+ */
+#define NFT_ARRAY_FOREACH(a, s, element) \
+        for((s) = nft_array_iter_begin(a); \
+            (s) != NFT_ARRAY_SLOT_INVALID && \
+            (((element) = nft_array_get_element_unchecked((a), (s))), true); \
+            (s) = nft_array_iter_next((a), (s)))
+
+
 #endif /** _NIFTYPREFS_ARRAY_H */
 
 /**
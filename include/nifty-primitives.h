@@ -56,6 +56,9 @@
 #define _NFT_PRIMITIVES
 
 
+#include <stddef.h>
+
+
 #ifndef NFT_RESULT_DEFINED
 #define NFT_RESULT_DEFINED
 /** type for returning failure-status */
@@ -67,6 +70,20 @@ typedef enum
 #endif
 
 
+/** custom memory allocator */
+typedef struct _NftAllocator
+{
+        /** allocate size bytes (like malloc()) */
+        void                           *(*alloc) (size_t size, void *userptr);
+        /** resize memory previously allocated by this allocator (like realloc()) */
+        void                           *(*realloc) (void *ptr, size_t size, void *userptr);
+        /** release memory previously allocated by this allocator (like free()) */
+        void                            (*free) (void *ptr, void *userptr);
+        /** arbitrary pointer passed to all functions */
+        void                           *userptr;
+} NftAllocator;
+
+
 
 #endif /** _NFT_PRIMITIVES */
 
@@ -61,6 +61,7 @@
 #include "nifty-primitives.h"
 #include "nifty-array.h"
 #include "niftyprefs-obj.h"
+#include "niftyprefs-updater.h"
 
 
 
@@ -75,12 +76,70 @@ typedef NftArray                NftPrefsClasses;
     you have one "Person" class) */
 typedef struct _NftPrefsClass   NftPrefsClass;
 
+/** static description of a class (s. nft_prefs_class_register_table()) */
+typedef struct
+{
+        /** unique name of class */
+        const char *name;
+        /** NftPrefsToObjFunc of class */
+        NftPrefsToObjFunc *toObj;
+        /** NftPrefsFromObjFunc of class */
+        NftPrefsFromObjFunc *fromObj;
+        /** updaters of class (or NULL) */
+        const NftPrefsUpdaterDesc *updaters;
+        /** amount of entries in updaters */
+        size_t updaterCount;
+        /** true if updaters may run in parallel (s. nft_prefs_updater_set_threadsafe()) */
+        bool threadsafe;
+} NftPrefsClassDesc;
+
+/** statistics of one kind of callback (s. NftPrefsClassStats) */
+typedef struct
+{
+        /** amount of calls */
+        uint64_t calls;
+        /** amount of calls that returned NFT_FAILURE */
+        uint64_t failures;
+        /** wall time spent in all calls (nanoseconds) */
+        uint64_t totalNs;
+        /** wall time of the slowest call (nanoseconds) */
+        uint64_t maxNs;
+} NftPrefsCallStats;
+
+/** performance counters of a class (s. nft_prefs_class_stats_enable()) */
+typedef struct
+{
+        /** NftPrefsToObjFunc called by nft_prefs_obj_from_node() */
+        NftPrefsCallStats toObj;
+        /** NftPrefsFromObjFunc called by nft_prefs_obj_to_node() */
+        NftPrefsCallStats fromObj;
+        /** NftPrefsUpdaterFunc called while parsing preferences */
+        NftPrefsCallStats updater;
+        /** element nodes produced by NftPrefsFromObjFunc (including the
+            node itself & all nodes below it) */
+        uint64_t nodes;
+} NftPrefsClassStats;
+
+/**
+ * function called by nft_prefs_class_stats_foreach() for each class
+ *
+ * @param className name of class
+ * @param stats counters of class
+ * @param userptr arbitrary pointer passed to nft_prefs_class_stats_foreach()
+ */
+typedef void                    (NftPrefsClassStatsFunc) (const char *className, const NftPrefsClassStats * stats, void *userptr);
+
 
 
 
 
 NftResult                       nft_prefs_class_register(NftPrefs * p, const char *className, NftPrefsToObjFunc * toObj, NftPrefsFromObjFunc * fromObj);
+NftResult                       nft_prefs_class_register_table(NftPrefs * p, const NftPrefsClassDesc * table, size_t n);
 void                            nft_prefs_class_unregister(NftPrefs * p, const char *className);
+NftResult                       nft_prefs_class_compact(NftPrefs * p);
+NftPrefsClassId                 nft_prefs_class_get_handle(NftPrefs * p, const char *className);
+void                            nft_prefs_class_stats_enable(NftPrefs * p, bool enable);
+void                            nft_prefs_class_stats_foreach(NftPrefs * p, NftPrefsClassStatsFunc * func, void *userptr);
 
 
 
@@ -77,6 +77,17 @@
 /** wrapper type for one xmlNode */
 typedef xmlNode                 NftPrefsNode;
 
+/** what nft_prefs_node_from_file() does with a file it had to update (s. nft_prefs_node_set_writeback()) */
+typedef enum
+{
+        /** keep updated preferences in memory only (default) */
+        NFT_PREFS_WRITEBACK_NONE = 0,
+        /** replace the file with the updated preferences */
+        NFT_PREFS_WRITEBACK_INPLACE,
+        /** keep the file & write the updated preferences to "<file>.cache" */
+        NFT_PREFS_WRITEBACK_SIDECAR,
+} NftPrefsWriteback;
+
 
 
 NftResult                       nft_prefs_node_add_child(NftPrefsNode * parent, NftPrefsNode * cur);
@@ -93,6 +104,7 @@ NftResult                       nft_prefs_node_to_file(NftPrefs *p, NftPrefsNode
 NftResult                       nft_prefs_node_to_file_minimal(NftPrefs *p, NftPrefsNode * n, const char *filename, bool overwrite);
 NftPrefsNode                   *nft_prefs_node_from_buffer(NftPrefs *p, char *buffer, size_t bufsize);
 NftPrefsNode                   *nft_prefs_node_from_file(NftPrefs *p, const char *filename);
+NftResult                       nft_prefs_node_set_writeback(NftPrefs *p, NftPrefsWriteback mode);
 
 
 NftPrefsNode                   *nft_prefs_node_alloc(const char *name);
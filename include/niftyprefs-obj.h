@@ -96,6 +96,8 @@ typedef                         NftResult(NftPrefsToObjFunc) (NftPrefs * p, void
 
 void                           *nft_prefs_obj_from_node(NftPrefs * p, NftPrefsNode * n, void *userptr);
 NftPrefsNode                   *nft_prefs_obj_to_node(NftPrefs * p, const char *className, void *obj, void *userptr);
+void                           *nft_prefs_obj_from_node_by_id(NftPrefs * p, NftPrefsClassId id, NftPrefsNode * n, void *userptr);
+NftPrefsNode                   *nft_prefs_obj_to_node_by_id(NftPrefs * p, NftPrefsClassId id, void *obj, void *userptr);
 
 
 
@@ -82,9 +82,23 @@ typedef              struct _NftPrefsUpdater NftPrefsUpdater;
 typedef              NftResult(NftPrefsUpdaterFunc)(NftPrefsNode *node, unsigned int version, void *userptr);
 
 
+/** updater of a NftPrefsClassDesc (s. nft_prefs_class_register_table()) */
+typedef struct
+{
+        /** update handler */
+        NftPrefsUpdaterFunc *updater;
+        /** update nodes with this version (to version+1) */
+        unsigned int version;
+        /** arbitrary pointer that will be passed to the update handler */
+        void *userptr;
+} NftPrefsUpdaterDesc;
+
+
 
 
 NftResult            nft_prefs_updater_register(NftPrefs *p, NftPrefsUpdaterFunc *updater, const char *className, unsigned int version, void *userptr);
+NftResult            nft_prefs_updater_set_threadsafe(NftPrefs *p, const char *className, bool threadsafe);
+NftResult            nft_prefs_updater_set_threads(NftPrefs *p, unsigned int threads);
 
 
 #endif /** _NIFTYPREFS_UPDATER_H */
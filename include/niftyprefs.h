@@ -98,6 +98,12 @@
  *  - create object:
  *    foo = nft_prefs_obj_from_node(prefsNode, "OBJ-KLASS-NAME");
  *
+ * Use case 3: Many contexts with the same classes
+ *  - register classes & updaters once using one context
+ *  - registry = nft_prefs_registry_ref(prefs);
+ *  - prefs2 = nft_prefs_init_shared(version, registry); ...
+ *  - nft_prefs_registry_unref(registry);
+ *
  * For detailed examples, see sources in the "tests" subdirectory.
  * 
  * @defgroup prefs niftyprefs
@@ -109,12 +115,22 @@
 #define _NIFTYPREFS_H
 
 #include <sys/types.h>
+#include <stdint.h>
 
 
 
 /** a context holding a list of PrefsClasses and PrefsNodes - acquired by nft_prefs_init() */
 typedef struct _NftPrefs        NftPrefs;
 
+/** classes & updaters shared by many contexts - acquired by nft_prefs_registry_ref() */
+typedef struct _NftPrefsRegistry NftPrefsRegistry;
+
+/** opaque id of a registered class - acquired by nft_prefs_class_get_handle() */
+typedef uint64_t                NftPrefsClassId;
+
+/** NftPrefsClassId that never refers to a class */
+#define NFT_PREFS_CLASS_ID_INVALID ((NftPrefsClassId) -1)
+
 
 #include "nifty-primitives.h"
 #include "nifty-array.h"
@@ -136,8 +152,14 @@ typedef struct _NftPrefs        NftPrefs;
 
 
 NftPrefs                       *nft_prefs_init(unsigned int version);
+NftPrefs                       *nft_prefs_init_with_allocator(unsigned int version, const NftAllocator * allocator);
 void                            nft_prefs_deinit(NftPrefs * prefs);
+NftResult                       nft_prefs_freeze(NftPrefs * p);
+NftPrefsRegistry               *nft_prefs_registry_ref(NftPrefs * p);
+void                            nft_prefs_registry_unref(NftPrefsRegistry * r);
+NftPrefs                       *nft_prefs_init_shared(unsigned int version, NftPrefsRegistry * r);
 void                            nft_prefs_free(void *p);
+NftResult                       nft_prefs_set_xml_allocator(const NftAllocator * allocator);
 
 
 
@@ -55,13 +55,60 @@
 
 #include <niftylog.h>
 #include "nifty-array.h"
+#include "allocator.h"
+#include "config.h"
+
+
+/** amount of slots described by one word of NftArray->occupied */
+#define WORD_BITS NFT_ARRAY_WORD_BITS
+/** amount of words needed for a bitmap of n slots */
+#define WORDS(n) (((n) + WORD_BITS - 1) / WORD_BITS)
+/** NftArray->freehead: lower 32 bits if free-slot list is empty */
+#define FREEHEAD_EMPTY ((uint64_t) 0xffffffff)
+
+
+/** one entry of an NftArrayIndex hashtable */
+typedef struct
+{
+        /** hash of the element's key */
+        size_t hash;
+        /** slot of the element or NFT_ARRAY_SLOT_INVALID if entry is empty */
+        NftArraySlot slot;
+} NftIndexEntry;
+
+
+/** key index of an NftArray (open addressing, linear probing) */
+struct _NftArrayIndex
+{
+        /** function to get the key of an element */
+        NftArrayKeyFunc *key;
+        /** function to hash a key */
+        NftArrayHashFunc *hash;
+        /** function to compare two keys */
+        NftArrayKeyEqualFunc *equal;
+        /** hashtable (size is a power of 2) */
+        NftIndexEntry *entries;
+        /** amount of entries the hashtable can hold */
+        size_t size;
+        /** amount of entries currently in hashtable */
+        size_t count;
+        /** freshly allocated slots whose key isn't indexed, yet */
+        NftArraySlot *pending;
+        /** amount of slots in pending */
+        size_t pendingcount;
+        /** amount of slots pending can hold */
+        size_t pendingsize;
+};
 
 
 /** descriptor for one array element */
 struct _NftElement
 {
-        /** true if element is occupied, false if it's free */
-        bool occupied;
+        /** next free slot if this element is part of the free-slot list,
+            position in NftArrayIndex->pending if its key is pending */
+        NftArraySlot next;
+        /** incremented whenever the slot gets freed (s. NftArrayHandle) */
+        uint32_t generation;
 };
 
 
@@ -95,6 +142,688 @@ static bool _slot_is_valid(NftArray * a, NftArraySlot s)
 }
 
 
+/** amount of leading zero bits (w must not be 0) */
+static inline unsigned int _clz(uint64_t w)
+{
+#ifdef HAVE_BUILTIN_CTZLL
+        return __builtin_clzll(w);
+#else
+        unsigned int n = 0;
+        while(!(w & ((uint64_t) 1 << (WORD_BITS - 1))))
+        {
+                w <<= 1;
+                n++;
+        }
+        return n;
+#endif
+}
+
+
+/** check if slot is occupied */
+static inline bool _is_occupied(NftArray * a, NftArraySlot s)
+{
+        return (_NFT_ARRAY_LOAD(&a->occupied[s / WORD_BITS]) >>
+                (s % WORD_BITS)) & 1;
+}
+
+
+/** mark n consecutive slots starting at s as occupied */
+static void _set_occupied_range(NftArray * a, NftArraySlot s, size_t n)
+{
+        while(n)
+        {
+                size_t bit = s % WORD_BITS;
+                size_t count = WORD_BITS - bit;
+                if(count > n)
+                        count = n;
+
+                uint64_t mask = (count == WORD_BITS) ?
+                        ~((uint64_t) 0) :
+                        (((uint64_t) 1 << count) - 1) << bit;
+                a->occupied[s / WORD_BITS] |= mask;
+
+                s += count;
+                n -= count;
+        }
+}
+
+
+/** mark slot as occupied or free */
+static inline void _set_occupied(NftArray * a, NftArraySlot s, bool occupied)
+{
+        if(occupied)
+                a->occupied[s / WORD_BITS] |= (uint64_t) 1 << (s % WORD_BITS);
+        else
+                a->occupied[s / WORD_BITS] &= ~((uint64_t) 1 << (s % WORD_BITS));
+}
+
+
+#ifdef HAVE_BUILTIN_ATOMIC
+
+/** make sure chunk c of a NFT_ARRAY_CONCURRENT array exists */
+static NftResult _concurrent_chunk(NftArray * a, size_t c)
+{
+        if(__atomic_load_n(&a->chunks[c], __ATOMIC_ACQUIRE))
+                return NFT_SUCCESS;
+
+        char *chunk;
+        if(!(chunk = _mem_calloc(a->allocator,
+                                 NFT_ARRAY_CHUNK_SIZE, a->elementsize)))
+        {
+                NFT_LOG_PERROR("calloc()");
+                return NFT_FAILURE;
+        }
+
+        /* another thread might have been faster */
+        char *expected = NULL;
+        if(!__atomic_compare_exchange_n(&a->chunks[c], &expected, chunk, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                _mem_free(a->allocator, chunk);
+
+        return NFT_SUCCESS;
+}
+
+
+/** push slot to free-slot list of a NFT_ARRAY_CONCURRENT array */
+static void _concurrent_push(NftArray * a, NftArraySlot s)
+{
+        uint64_t head = __atomic_load_n(&a->freehead, __ATOMIC_RELAXED);
+        uint64_t newhead;
+        do
+        {
+                uint64_t top = head & FREEHEAD_EMPTY;
+                __atomic_store_n(&a->elements[s].next,
+                                 top == FREEHEAD_EMPTY ?
+                                 NFT_ARRAY_SLOT_INVALID : (NftArraySlot) top,
+                                 __ATOMIC_RELAXED);
+
+                /* bump ABA counter on every change */
+                newhead = (((head >> 32) + 1) << 32) | s;
+        }
+        while(!__atomic_compare_exchange_n(&a->freehead, &head, newhead, true,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/** pop slot from free-slot list of a NFT_ARRAY_CONCURRENT array */
+static NftArraySlot _concurrent_pop(NftArray * a)
+{
+        uint64_t head = __atomic_load_n(&a->freehead, __ATOMIC_ACQUIRE);
+        uint64_t newhead;
+        do
+        {
+                uint64_t top = head & FREEHEAD_EMPTY;
+                if(top == FREEHEAD_EMPTY)
+                        return NFT_ARRAY_SLOT_INVALID;
+
+                /* next might be stale if another thread popped top in the
+                 * meantime, but then the ABA counter changed and CAS fails */
+                NftArraySlot next = __atomic_load_n(&a->elements[top].next,
+                                                    __ATOMIC_RELAXED);
+                newhead = (((head >> 32) + 1) << 32) |
+                        (next == NFT_ARRAY_SLOT_INVALID ?
+                         FREEHEAD_EMPTY : (uint64_t) next);
+        }
+        while(!__atomic_compare_exchange_n(&a->freehead, &head, newhead, true,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+        return (NftArraySlot) (head & FREEHEAD_EMPTY);
+}
+
+
+/** reserve n consecutive untouched slots of a NFT_ARRAY_CONCURRENT array */
+static NftResult _concurrent_take(NftArray * a, size_t n, NftArraySlot * first)
+{
+        size_t used = __atomic_load_n(&a->used, __ATOMIC_RELAXED);
+        do
+        {
+                if(a->arraysize - used < n)
+                {
+                        NFT_LOG(L_ERROR,
+                                "concurrent array \"%s\" is full (%d slots)",
+                                nft_array_get_name(a), a->arraysize);
+                        return NFT_FAILURE;
+                }
+        }
+        while(!__atomic_compare_exchange_n(&a->used, &used, used + n, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        /* make sure all chunks of the new slots exist */
+        size_t c;
+        for(c = used >> NFT_ARRAY_CHUNK_SHIFT;
+            c <= (used + n - 1) >> NFT_ARRAY_CHUNK_SHIFT; c++)
+        {
+                if(!_concurrent_chunk(a, c))
+                {
+                        /* slots can't be given back to "used", so they
+                         * become free slots (their chunk is created when
+                         * they get popped again) */
+                        size_t i;
+                        for(i = 0; i < n; i++)
+                                _concurrent_push(a, used + i);
+                        return NFT_FAILURE;
+                }
+        }
+
+        *first = used;
+
+        return NFT_SUCCESS;
+}
+
+
+/** nft_array_slot_alloc() for NFT_ARRAY_CONCURRENT arrays */
+static NftResult _concurrent_slot_alloc(NftArray * a, NftArraySlot * s)
+{
+        /* reuse previously freed slot or take next untouched one */
+        NftArraySlot i;
+        if((i = _concurrent_pop(a)) != NFT_ARRAY_SLOT_INVALID)
+        {
+                if(!_concurrent_chunk(a, i >> NFT_ARRAY_CHUNK_SHIFT))
+                {
+                        _concurrent_push(a, i);
+                        return NFT_FAILURE;
+                }
+        }
+        else if(!_concurrent_take(a, 1, &i))
+                return NFT_FAILURE;
+
+        /* publish slot */
+        __atomic_store_n(&a->elements[i].next, NFT_ARRAY_SLOT_INVALID,
+                         __ATOMIC_RELAXED);
+        __atomic_fetch_or(&a->occupied[i / WORD_BITS],
+                          (uint64_t) 1 << (i % WORD_BITS), __ATOMIC_RELEASE);
+        __atomic_fetch_add(&a->elementcount, 1, __ATOMIC_RELAXED);
+
+        *s = i;
+
+        return NFT_SUCCESS;
+}
+
+
+/** nft_array_slot_alloc_n() for NFT_ARRAY_CONCURRENT arrays */
+static NftResult _concurrent_slot_alloc_n(NftArray * a, size_t n,
+                                          NftArraySlot * slots)
+{
+        NftArraySlot first;
+        if(!_concurrent_take(a, n, &first))
+                return NFT_FAILURE;
+
+        /* publish slots */
+        size_t i;
+        for(i = 0; i < n; i++)
+        {
+                NftArraySlot s = first + i;
+                __atomic_store_n(&a->elements[s].next, NFT_ARRAY_SLOT_INVALID,
+                                 __ATOMIC_RELAXED);
+                __atomic_fetch_or(&a->occupied[s / WORD_BITS],
+                                  (uint64_t) 1 << (s % WORD_BITS),
+                                  __ATOMIC_RELEASE);
+                slots[i] = s;
+        }
+        __atomic_fetch_add(&a->elementcount, n, __ATOMIC_RELAXED);
+
+        return NFT_SUCCESS;
+}
+
+
+/** nft_array_slot_free() for NFT_ARRAY_CONCURRENT arrays */
+static void _concurrent_slot_free(NftArray * a, NftArraySlot s)
+{
+        /* clearing the occupied-bit decides which thread frees the slot */
+        uint64_t bit = (uint64_t) 1 << (s % WORD_BITS);
+        if(!(__atomic_fetch_and(&a->occupied[s / WORD_BITS], ~bit,
+                                __ATOMIC_ACQ_REL) & bit))
+        {
+                NFT_LOG(L_ERROR,
+                        "tried to free unallocated slot \"%d\" from array \"%s\".",
+                        s, nft_array_get_name(a));
+                return;
+        }
+
+        /* clear element & invalidate handles to it */
+        memset(nft_array_get_element_unchecked(a, s), 0, a->elementsize);
+        __atomic_fetch_add(&a->elements[s].generation, 1, __ATOMIC_RELEASE);
+        __atomic_fetch_sub(&a->elementcount, 1, __ATOMIC_RELAXED);
+
+        _concurrent_push(a, s);
+}
+
+#endif /* HAVE_BUILTIN_ATOMIC */
+
+
+/**
+ * resize element storage of a stable array chunk-wise. Existing chunks
+ * never move.
+ *
+ * @param a NftArray descriptor
+ * @param arraysize new size (multiple of NFT_ARRAY_CHUNK_SIZE)
+ * @result NFT_SUCCESS or NFT_FAILURE
+ */
+static NftResult _resize_chunks(NftArray * a, size_t arraysize)
+{
+        size_t oldcount = a->arraysize >> NFT_ARRAY_CHUNK_SHIFT;
+        size_t newcount = arraysize >> NFT_ARRAY_CHUNK_SHIFT;
+
+        /* release chunks that vanish */
+        size_t c;
+        for(c = newcount; c < oldcount; c++)
+                _mem_free(a->allocator, a->chunks[c]);
+
+        /* release chunk table? */
+        if(newcount == 0)
+        {
+                _mem_free(a->allocator, a->chunks);
+                a->chunks = NULL;
+                return NFT_SUCCESS;
+        }
+
+        /* resize chunk table (if shrinking fails, the old table is still
+         * large enough) */
+        char **chunks;
+        if((chunks = _mem_realloc(a->allocator, a->chunks,
+                                    newcount * sizeof(char *))))
+                a->chunks = chunks;
+        else if(newcount > oldcount)
+        {
+                NFT_LOG_PERROR("realloc()");
+                return NFT_FAILURE;
+        }
+
+        /* allocate new chunks */
+        for(c = oldcount; c < newcount; c++)
+        {
+                if(!(a->chunks[c] = _mem_calloc(a->allocator,
+                                                NFT_ARRAY_CHUNK_SIZE,
+                                                a->elementsize)))
+                {
+                        NFT_LOG_PERROR("calloc()");
+
+                        /* release chunks allocated so far */
+                        while(c-- > oldcount)
+                                _mem_free(a->allocator, a->chunks[c]);
+
+                        return NFT_FAILURE;
+                }
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * resize element storage of a contiguous array
+ *
+ * @param a NftArray descriptor
+ * @param arraysize new size
+ * @result NFT_SUCCESS or NFT_FAILURE
+ */
+static NftResult _resize_buffer(NftArray * a, size_t arraysize)
+{
+        /* release buffer? */
+        if(arraysize == 0)
+        {
+                _mem_free(a->allocator, a->buffer);
+                a->buffer = NULL;
+                return NFT_SUCCESS;
+        }
+
+        /* resize element buffer (if shrinking fails, the old memory is
+         * still large enough) */
+        char *buffer;
+        if((buffer = _mem_realloc(a->allocator, a->buffer,
+                                    arraysize * a->elementsize)))
+                a->buffer = buffer;
+        else if(arraysize > a->arraysize)
+        {
+                NFT_LOG_PERROR("realloc()");
+                return NFT_FAILURE;
+        }
+
+        /* clear new memory */
+        if(arraysize > a->arraysize)
+        {
+                memset(&a->buffer[a->elementsize * a->arraysize], 0,
+                       (arraysize - a->arraysize) * a->elementsize);
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * change the amount of elements an array can hold
+ *
+ * @param a NftArray descriptor
+ * @param arraysize new size (must be >= NftArray->used)
+ * @result NFT_SUCCESS or NFT_FAILURE
+ */
+static NftResult _resize(NftArray * a, size_t arraysize)
+{
+        /* concurrent arrays never move their storage */
+        if((a->flags & NFT_ARRAY_CONCURRENT) && arraysize)
+        {
+                NFT_LOG(L_ERROR, "can't resize concurrent array \"%s\"",
+                        nft_array_get_name(a));
+                return NFT_FAILURE;
+        }
+
+        /* stable arrays always consist of whole chunks */
+        if(a->flags & NFT_ARRAY_STABLE)
+                arraysize = (arraysize + NFT_ARRAY_CHUNK_SIZE - 1) &
+                        ~((size_t) NFT_ARRAY_CHUNK_SIZE - 1);
+
+        if(arraysize == a->arraysize)
+                return NFT_SUCCESS;
+
+        /* handles of released descriptors must stay stale when the array
+         * grows again */
+        size_t e;
+        for(e = arraysize; e < a->arraysize; e++)
+        {
+                if(a->elements[e].generation >= a->generation)
+                        a->generation = a->elements[e].generation + 1;
+        }
+
+        /* resize element descriptor array & occupancy bitmap (if shrinking
+         * fails, the old memory is still large enough) */
+        if(arraysize == 0)
+        {
+                _mem_free(a->allocator, a->elements);
+                _mem_free(a->allocator, a->occupied);
+                a->elements = NULL;
+                a->occupied = NULL;
+        }
+        else
+        {
+                uint64_t *occupied;
+                if((occupied = _mem_realloc(a->allocator, a->occupied,
+                                            WORDS(arraysize) *
+                                            sizeof(uint64_t))))
+                        a->occupied = occupied;
+                else if(arraysize > a->arraysize)
+                {
+                        NFT_LOG_PERROR("realloc()");
+                        return NFT_FAILURE;
+                }
+
+
+                NftElement *elements;
+                if((elements =
+                    _mem_realloc(a->allocator, a->elements,
+                                 arraysize * sizeof(NftElement))))
+                        a->elements = elements;
+                else if(arraysize > a->arraysize)
+                {
+                        NFT_LOG_PERROR("realloc()");
+                        return NFT_FAILURE;
+                }
+        }
+
+        /* resize element storage */
+        if(!((a->flags & NFT_ARRAY_STABLE) ?
+             _resize_chunks(a, arraysize) : _resize_buffer(a, arraysize)))
+                return NFT_FAILURE;
+
+        /* clear new descriptors */
+        if(arraysize > a->arraysize)
+        {
+                for(e = a->arraysize; e < arraysize; e++)
+                {
+                        a->elements[e].next = 0;
+                        a->elements[e].generation = a->generation;
+                }
+                memset(&a->occupied[WORDS(a->arraysize)], 0,
+                       (WORDS(arraysize) -
+                        WORDS(a->arraysize)) * sizeof(uint64_t));
+        }
+
+        /* remember new arraysize */
+        a->arraysize = arraysize;
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * allocate the fixed-size tables of a NFT_ARRAY_CONCURRENT array. Chunks
+ * are allocated on demand by the thread that needs them first.
+ *
+ * @param a NftArray descriptor
+ * @param arraysize capacity of array (multiple of NFT_ARRAY_CHUNK_SIZE)
+ * @result NFT_SUCCESS or NFT_FAILURE
+ */
+static NftResult _concurrent_setup(NftArray * a, size_t arraysize)
+{
+        if(!(a->elements = _mem_calloc(a->allocator,
+                                       arraysize, sizeof(NftElement))) ||
+           !(a->occupied = _mem_calloc(a->allocator,
+                                       WORDS(arraysize), sizeof(uint64_t))) ||
+           !(a->chunks = _mem_calloc(a->allocator,
+                                     arraysize >> NFT_ARRAY_CHUNK_SHIFT,
+                                     sizeof(char *))))
+        {
+                NFT_LOG_PERROR("calloc()");
+                _mem_free(a->allocator, a->elements);
+                _mem_free(a->allocator, a->occupied);
+                a->elements = NULL;
+                a->occupied = NULL;
+                return NFT_FAILURE;
+        }
+
+        a->arraysize = arraysize;
+        a->freehead = FREEHEAD_EMPTY;
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * grow array geometrically so it can hold at least one more element
+ *
+ * @param a NftArray descriptor
+ * @result NFT_SUCCESS or NFT_FAILURE
+ */
+static NftResult _grow(NftArray * a)
+{
+        /* double size but grow at least by NFT_ARRAY_DEFAULT_INC elements */
+        size_t inc = a->arraysize;
+        if(inc < NFT_ARRAY_DEFAULT_INC)
+                inc = NFT_ARRAY_DEFAULT_INC;
+
+        return _resize(a, a->arraysize + inc);
+}
+
+
+
+/** resize hashtable of an array's index */
+static NftResult _index_resize(NftArray * a, size_t size)
+{
+        NftArrayIndex *x = a->index;
+
+        NftIndexEntry *entries;
+        if(!(entries = _mem_alloc(a->allocator, size * sizeof(NftIndexEntry))))
+        {
+                NFT_LOG_PERROR("malloc()");
+                return NFT_FAILURE;
+        }
+
+        /* mark all entries as empty */
+        size_t i;
+        for(i = 0; i < size; i++)
+                entries[i].slot = NFT_ARRAY_SLOT_INVALID;
+
+        /* rehash old entries */
+        for(i = 0; i < x->size; i++)
+        {
+                if(x->entries[i].slot == NFT_ARRAY_SLOT_INVALID)
+                        continue;
+
+                size_t e = x->entries[i].hash & (size - 1);
+                while(entries[e].slot != NFT_ARRAY_SLOT_INVALID)
+                        e = (e + 1) & (size - 1);
+
+                entries[e] = x->entries[i];
+        }
+
+        _mem_free(a->allocator, x->entries);
+        x->entries = entries;
+        x->size = size;
+
+        return NFT_SUCCESS;
+}
+
+
+/** add element to hashtable of an index */
+static NftResult _index_insert(NftArray * a, NftArraySlot s)
+{
+        NftArrayIndex *x = a->index;
+
+        /* keep load factor below 3/4 */
+        if((x->count + 1) * 4 > x->size * 3)
+        {
+                if(!_index_resize(a, x->size ? x->size * 2 : 16))
+                        return NFT_FAILURE;
+        }
+
+        size_t hash = x->hash(x->key(nft_array_get_element_unchecked(a, s)));
+        size_t e = hash & (x->size - 1);
+        while(x->entries[e].slot != NFT_ARRAY_SLOT_INVALID)
+                e = (e + 1) & (x->size - 1);
+
+        x->entries[e].hash = hash;
+        x->entries[e].slot = s;
+        x->count++;
+
+        return NFT_SUCCESS;
+}
+
+
+/** remove element from hashtable of an index */
+static void _index_remove(NftArray * a, NftArraySlot s)
+{
+        NftArrayIndex *x = a->index;
+
+        if(!x->size)
+                return;
+
+        /* find entry of slot */
+        size_t mask = x->size - 1;
+        size_t e = x->hash(x->key(nft_array_get_element_unchecked(a, s))) & mask;
+        while(x->entries[e].slot != s)
+        {
+                if(x->entries[e].slot == NFT_ARRAY_SLOT_INVALID)
+                {
+                        NFT_LOG(L_ERROR,
+                                "slot %d of array \"%s\" missing in index. Key modified after it was indexed?",
+                                s, nft_array_get_name(a));
+                        return;
+                }
+                e = (e + 1) & mask;
+        }
+
+        /* shift following entries of the same cluster back (no tombstones) */
+        size_t next = e;
+        for(;;)
+        {
+                next = (next + 1) & mask;
+                if(x->entries[next].slot == NFT_ARRAY_SLOT_INVALID)
+                        break;
+
+                /* entry may only move if its home isn't between e and next */
+                size_t home = x->entries[next].hash & mask;
+                if((next > e && (home <= e || home > next)) ||
+                   (next < e && (home <= e && home > next)))
+                {
+                        x->entries[e] = x->entries[next];
+                        e = next;
+                }
+        }
+
+        x->entries[e].slot = NFT_ARRAY_SLOT_INVALID;
+        x->count--;
+}
+
+
+/** update index entry of an element that moved from one slot to another */
+static void _index_move(NftArray * a, NftArraySlot from, NftArraySlot to)
+{
+        NftArrayIndex *x = a->index;
+
+        if(!x->size)
+                return;
+
+        size_t mask = x->size - 1;
+        size_t e = x->hash(x->key(nft_array_get_element_unchecked(a, to))) & mask;
+        while(x->entries[e].slot != from)
+        {
+                if(x->entries[e].slot == NFT_ARRAY_SLOT_INVALID)
+                {
+                        NFT_LOG(L_ERROR,
+                                "slot %d of array \"%s\" missing in index. Key modified after it was indexed?",
+                                from, nft_array_get_name(a));
+                        return;
+                }
+                e = (e + 1) & mask;
+        }
+
+        x->entries[e].slot = to;
+}
+
+
+/** add keys of all pending slots to index */
+static NftResult _index_flush(NftArray * a)
+{
+        NftArrayIndex *x = a->index;
+
+        while(x->pendingcount)
+        {
+                if(!_index_insert(a, x->pending[x->pendingcount - 1]))
+                        return NFT_FAILURE;
+
+                x->pendingcount--;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/** index keys of all pending slots and make room for n new pending slots */
+static NftResult _index_prepare(NftArray * a, size_t n)
+{
+        NftArrayIndex *x = a->index;
+
+        if(!_index_flush(a))
+                return NFT_FAILURE;
+
+        if(x->pendingsize < n)
+        {
+                NftArraySlot *pending;
+                if(!(pending = _mem_realloc(a->allocator, x->pending,
+                                            n * sizeof(NftArraySlot))))
+                {
+                        NFT_LOG_PERROR("realloc()");
+                        return NFT_FAILURE;
+                }
+                x->pending = pending;
+                x->pendingsize = n;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/** forget all entries of an index */
+static void _index_reset(NftArrayIndex * x)
+{
+        size_t i;
+        for(i = 0; i < x->size; i++)
+                x->entries[i].slot = NFT_ARRAY_SLOT_INVALID;
+
+        x->count = 0;
+        x->pendingcount = 0;
+}
+
+
 
 /******************************************************************************/
 /**************************** PRIVATE FUNCTIONS *******************************/
@@ -123,11 +852,83 @@ NftResult nft_array_init(NftArray * a, size_t elementSize)
         memset(a, 0, sizeof(NftArray));
 
         a->elementsize = elementSize;
+        a->freelist = NFT_ARRAY_SLOT_INVALID;
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * initialize an array descriptor whose elements never move in memory. 
+ * Elements are stored in chunks of NFT_ARRAY_CHUNK_SIZE elements that stay
+ * in place until the array shrinks below them, so pointers returned by
+ * nft_array_get_element() stay valid as long as their slot is allocated
+ * (and nft_array_compact() doesn't move them).
+ *
+ * @param a pointer to space that should be initialized to be used as NftArray
+ * @param elementSize size of one array element in bytes 
+ * @result NFT_SUCCESS or NFT_FAILURE 
+ */
+NftResult nft_array_init_stable(NftArray * a, size_t elementSize)
+{
+        if(!nft_array_init(a, elementSize))
+                return NFT_FAILURE;
+
+        a->flags |= NFT_ARRAY_STABLE;
 
         return NFT_SUCCESS;
 }
 
 
+/**
+ * initialize a stable array whose slots can be allocated and freed by
+ * multiple threads at once without locking. Other threads may look up
+ * elements (nft_array_get_element(), handles, NFT_ARRAY_FOREACH) at the
+ * same time.
+ *
+ * The capacity of a concurrent array is fixed: the tables describing all
+ * slots are allocated right away, element chunks are allocated when they
+ * are needed first. Operations that would move or rebuild storage
+ * (nft_array_shrink_to_fit(), nft_array_compact(), nft_array_clear(), key
+ * indexes) are not available.
+ *
+ * @param a pointer to space that should be initialized to be used as NftArray
+ * @param elementSize size of one array element in bytes
+ * @param maxElements maximum amount of elements the array can hold
+ *        (<= NFT_ARRAY_HANDLE_MAX_SLOT)
+ * @result NFT_SUCCESS or NFT_FAILURE
+ * @note Freeing a slot while another thread still accesses its element is
+ *       a bug of the caller - use handles to detect reused slots. The
+ *       allocator (s. nft_array_set_allocator()) must be thread-safe.
+ */
+NftResult nft_array_init_concurrent(NftArray * a, size_t elementSize,
+                                    size_t maxElements)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        if(maxElements == 0 || maxElements > NFT_ARRAY_HANDLE_MAX_SLOT)
+        {
+                NFT_LOG(L_ERROR,
+                        "maxElements (%d) of concurrent array must be > 0 and <= NFT_ARRAY_HANDLE_MAX_SLOT",
+                        maxElements);
+                return NFT_FAILURE;
+        }
+
+        if(!nft_array_init_stable(a, elementSize))
+                return NFT_FAILURE;
+
+        a->flags |= NFT_ARRAY_CONCURRENT;
+
+        return _concurrent_setup(a,
+                                 (maxElements + NFT_ARRAY_CHUNK_SIZE - 1) &
+                                 ~((size_t) NFT_ARRAY_CHUNK_SIZE - 1));
+#else
+        NFT_LOG(L_ERROR,
+                "concurrent arrays are not supported by this build (no atomic builtins)");
+        return NFT_FAILURE;
+#endif
+}
+
+
 /**
  * release all resources used by an array
  *
@@ -139,180 +940,472 @@ void nft_array_deinit(NftArray * a)
         if(!a)
                 NFT_LOG_NULL();
 
-        free(a->elements);
-        free(a->buffer);
-        a->elements = NULL;
+        nft_array_index_disable(a);
+
+        _resize(a, 0);
         a->elementcount = 0;
         a->elementsize = 0;
         a->arraysize = 0;
+        a->used = 0;
+        a->freelist = NFT_ARRAY_SLOT_INVALID;
+}
+
+
+/**
+ * use a custom allocator for all memory of an array. This must be called
+ * before the first slot gets allocated (i.e. right after nft_array_init())
+ *
+ * @param a NftArray descriptor
+ * @param allocator NftAllocator to use or NULL for malloc()/realloc()/free().
+ *        The allocator must stay valid until nft_array_deinit()
+ * @result NFT_SUCCESS or NFT_FAILURE
+ */
+NftResult nft_array_set_allocator(NftArray * a, const NftAllocator * allocator)
+{
+        if(!a)
+                NFT_LOG_NULL(NFT_FAILURE);
+
+        if(a->used || a->index)
+        {
+                NFT_LOG(L_ERROR,
+                        "can't change allocator of array \"%s\" that already allocated memory",
+                        nft_array_get_name(a));
+                return NFT_FAILURE;
+        }
+
+        if(allocator && (!allocator->alloc || !allocator->realloc || !allocator->free))
+        {
+                NFT_LOG(L_ERROR, "incomplete allocator");
+                return NFT_FAILURE;
+        }
+
+        /* move memory that's already reserved to new allocator */
+        size_t arraysize = a->arraysize;
+        _resize(a, 0);
+        a->allocator = allocator;
+
+        if(!arraysize)
+                return NFT_SUCCESS;
+
+        if(a->flags & NFT_ARRAY_CONCURRENT)
+                return _concurrent_setup(a, arraysize);
+
+        return _resize(a, arraysize);
+}
+
+
+/**
+ * NftArray setter
+ *
+ * @param a NftArray descriptor
+ * @param name printable namestring with max. NFT_ARRAY_NAME_MAXLEN 
+ */
+void nft_array_set_name(NftArray * a, const char *name)
+{
+        if(!a || !name)
+                NFT_LOG_NULL();
+
+        strncpy(a->name, name, sizeof(a->name));
+}
+
+
+/**
+ * NftArray getter
+ *
+ * @param a NftArray descriptor
+ * @result printable name of array or NULL upon error
+ */
+const char *nft_array_get_name(NftArray * a)
+{
+        if(!a)
+                NFT_LOG_NULL(NULL);
+
+        return a->name[0] ? a->name : ("[unnamed]");
+}
+
+
+/**
+ * NftArray setter
+ */
+void nft_array_set_type(NftArray * a, int type)
+{
+        if(!a)
+                NFT_LOG_NULL();
+
+        a->type = type;
+}
+
+
+/**
+ * NftArray getter
+ *
+ * @param a NftArray descriptor
+ * @result type of NftArray or -1 upon failure
+ */
+int nft_array_get_type(NftArray * a)
+{
+        if(!a)
+                NFT_LOG_NULL(-1);
+
+        return a->type;
+}
+
+
+/**
+ * check type of an NftArray
+ *
+ * @param a NftArray descriptor
+ * @param type the type to compare a's type with
+ * @result true if "type" and type of NftArray match, false otherwise
+ */
+bool nft_array_is_type(NftArray * a, int type)
+{
+        if(!a)
+                NFT_LOG_NULL(false);
+
+        return (a->type == type);
+}
+
+
+/**
+ * NftArray getter
+ *
+ * @param a NftArray descriptor
+ * @result amount of elements currently in array or -1 upon error
+ */
+ssize_t nft_array_get_elementcount(NftArray * a)
+{
+        if(!a)
+                NFT_LOG_NULL(-1);
+
+        return _NFT_ARRAY_LOAD(&a->elementcount);
+}
+
+
+/**
+ * allocate a fresh slot from array so the pointer to the slot element can be
+ * received with nft_array_get_slot() 
+ * 
+ * @param a NftArray descriptor
+ * @param s pointer where new free slot will be written to 
+ * @result NFT_SUCCESS or NFT_FAILURE 
+ * @note Use nft_array_free_slot() if you don't need the slot anymore.
+ *       Previously freed slots are reused first (most recently freed first),
+ *       so allocation doesn't depend on the size of the array.
+ */
+NftResult nft_array_slot_alloc(NftArray * a, NftArraySlot * s)
+{
+        if(!a || !s)
+                NFT_LOG_NULL(NFT_FAILURE);
+
+#ifdef HAVE_BUILTIN_ATOMIC
+        if(a->flags & NFT_ARRAY_CONCURRENT)
+                return _concurrent_slot_alloc(a, s);
+#endif
+
+        /* index keys of previously allocated slots & make room for the new
+         * one */
+        NftArrayIndex *x = a->index;
+        if(x && !_index_prepare(a, 1))
+                return NFT_FAILURE;
+
+        NftArraySlot i;
+
+        /* reuse previously freed slot? */
+        if(a->freelist != NFT_ARRAY_SLOT_INVALID)
+        {
+                i = a->freelist;
+                a->freelist = a->elements[i].next;
+        }
+        /* take next untouched slot */
+        else
+        {
+                /* enough space left? */
+                if(a->arraysize <= a->used)
+                {
+                        if(!_grow(a))
+                                return NFT_FAILURE;
+                }
+
+                i = a->used++;
+        }
+
+        /* set element as occupied */
+        _set_occupied(a, i, true);
+        a->elements[i].next = NFT_ARRAY_SLOT_INVALID;
+
+        /* another element allocated... */
+        a->elementcount++;
+
+        /* key of element gets indexed after caller had a chance to set it */
+        if(x)
+        {
+                a->elements[i].next = x->pendingcount;
+                x->pending[x->pendingcount++] = i;
+        }
+
+        /* save slot */
+        *s = i;
+
+        return NFT_SUCCESS;
 }
 
 
 /**
- * NftArray setter
+ * allocate a run of consecutive fresh slots at once. This only resizes the
+ * array once and doesn't need to touch the new elements one by one. 
  *
  * @param a NftArray descriptor
- * @param name printable namestring with max. NFT_ARRAY_NAME_MAXLEN 
+ * @param n amount of slots to allocate
+ * @param slots space for n slots that will be filled with the new slots
+ *        (slots[i] == slots[0] + i)
+ * @result NFT_SUCCESS or NFT_FAILURE
+ * @note Slots are always taken from the end of the array, previously freed
+ *       slots are only reused by nft_array_slot_alloc()
  */
-void nft_array_set_name(NftArray * a, const char *name)
+NftResult nft_array_slot_alloc_n(NftArray * a, size_t n, NftArraySlot * slots)
 {
-        if(!a || !name)
-                NFT_LOG_NULL();
+        if(!a || !slots)
+                NFT_LOG_NULL(NFT_FAILURE);
 
-        strncpy(a->name, name, sizeof(a->name));
-}
+        if(n == 0)
+                return NFT_SUCCESS;
 
+#ifdef HAVE_BUILTIN_ATOMIC
+        if(a->flags & NFT_ARRAY_CONCURRENT)
+                return _concurrent_slot_alloc_n(a, n, slots);
+#endif
 
-/**
- * NftArray getter
- *
- * @param a NftArray descriptor
- * @result printable name of array or NULL upon error
- */
-const char *nft_array_get_name(NftArray * a)
-{
-        if(!a)
-                NFT_LOG_NULL(NULL);
+        /* index keys of previously allocated slots & make room for new ones */
+        NftArrayIndex *x = a->index;
+        if(x && !_index_prepare(a, n))
+                return NFT_FAILURE;
 
-        return a->name[0] ? a->name : ("[unnamed]");
-}
+        /* enough space left? */
+        if(a->arraysize < a->used + n)
+        {
+                /* grow geometrically but at least as much as needed */
+                size_t arraysize = a->arraysize * 2;
+                if(arraysize < a->used + n)
+                        arraysize = a->used + n;
 
+                if(!_resize(a, arraysize))
+                        return NFT_FAILURE;
+        }
 
-/**
- * NftArray setter
- */
-void nft_array_set_type(NftArray * a, int type)
-{
-        if(!a)
-                NFT_LOG_NULL();
+        /* untouched slots are already cleared, just mark them as occupied */
+        NftArraySlot first = a->used;
+        _set_occupied_range(a, first, n);
+        a->used += n;
+        a->elementcount += n;
 
-        a->type = type;
+        size_t i;
+        for(i = 0; i < n; i++)
+        {
+                slots[i] = first + i;
+
+                /* keys get indexed after caller had a chance to set them */
+                if(x)
+                {
+                        a->elements[first + i].next = x->pendingcount;
+                        x->pending[x->pendingcount++] = first + i;
+                }
+        }
+
+        return NFT_SUCCESS;
 }
 
 
 /**
- * NftArray getter
+ * free all slots of an array at once. The array keeps its size, use
+ * nft_array_shrink_to_fit() to release memory.
  *
  * @param a NftArray descriptor
- * @result type of NftArray or -1 upon failure
  */
-int nft_array_get_type(NftArray * a)
+void nft_array_clear(NftArray * a)
 {
         if(!a)
-                NFT_LOG_NULL(-1);
+                NFT_LOG_NULL();
 
-        return a->type;
+        if(a->flags & NFT_ARRAY_CONCURRENT)
+        {
+                NFT_LOG(L_ERROR, "can't clear concurrent array \"%s\"",
+                        nft_array_get_name(a));
+                return;
+        }
+
+        if(a->used == 0)
+                return;
+
+        /* clear index */
+        if(a->index)
+                _index_reset(a->index);
+
+        /* clear elements */
+        if(a->flags & NFT_ARRAY_STABLE)
+        {
+                size_t c;
+                for(c = 0; c < a->used; c += NFT_ARRAY_CHUNK_SIZE)
+                        memset(a->chunks[c >> NFT_ARRAY_CHUNK_SHIFT], 0,
+                               NFT_ARRAY_CHUNK_SIZE * a->elementsize);
+        }
+        else
+        {
+                memset(a->buffer, 0, a->used * a->elementsize);
+        }
+
+        /* invalidate handles */
+        NftArraySlot s;
+        for(s = 0; s < a->used; s++)
+                a->elements[s].generation++;
+
+        /* mark all slots as untouched */
+        memset(a->occupied, 0, WORDS(a->used) * sizeof(uint64_t));
+        a->used = 0;
+        a->freelist = NFT_ARRAY_SLOT_INVALID;
+        a->elementcount = 0;
 }
 
 
 /**
- * check type of an NftArray
+ * make sure an array can hold a certain amount of elements without
+ * reallocating. Use this before allocating lots of slots if the final
+ * amount is known in advance.
  *
  * @param a NftArray descriptor
- * @param type the type to compare a's type with
- * @result true if "type" and type of NftArray match, false otherwise
+ * @param n amount of elements the array should be able to hold
+ * @result NFT_SUCCESS or NFT_FAILURE
  */
-bool nft_array_is_type(NftArray * a, int type)
+NftResult nft_array_reserve(NftArray * a, size_t n)
 {
         if(!a)
-                NFT_LOG_NULL(false);
+                NFT_LOG_NULL(NFT_FAILURE);
 
-        return (a->type == type);
+        /* already large enough? */
+        if(a->arraysize >= n)
+                return NFT_SUCCESS;
+
+        return _resize(a, n);
 }
 
 
 /**
- * NftArray getter
+ * release memory of unused slots at the end of an array. Slots of
+ * allocated elements don't change.
  *
  * @param a NftArray descriptor
- * @result amount of elements currently in array or -1 upon error
+ * @result NFT_SUCCESS or NFT_FAILURE
  */
-ssize_t nft_array_get_elementcount(NftArray * a)
+NftResult nft_array_shrink_to_fit(NftArray * a)
 {
         if(!a)
-                NFT_LOG_NULL(-1);
+                NFT_LOG_NULL(NFT_FAILURE);
+
+        if(a->flags & NFT_ARRAY_CONCURRENT)
+        {
+                NFT_LOG(L_ERROR, "can't shrink concurrent array \"%s\"",
+                        nft_array_get_name(a));
+                return NFT_FAILURE;
+        }
+
+        /* find end of last occupied slot */
+        size_t top = 0, w;
+        for(w = WORDS(a->used); w > 0; w--)
+        {
+                if(a->occupied[w - 1])
+                {
+                        top = w * WORD_BITS - _clz(a->occupied[w - 1]);
+                        break;
+                }
+        }
 
-        return a->elementcount;
+        /* drop free slots that are about to vanish from free-slot list */
+        NftArraySlot *f = &a->freelist;
+        while(*f != NFT_ARRAY_SLOT_INVALID)
+        {
+                if(*f >= top)
+                        *f = a->elements[*f].next;
+                else
+                        f = &a->elements[*f].next;
+        }
+
+        a->used = top;
+
+        return _resize(a, top);
 }
 
 
 /**
- * allocate a fresh slot from array so the pointer to the slot element can be
- * received with nft_array_get_slot() 
- * 
+ * move all elements to the lowest slots and release the memory of all
+ * other slots. Use this after lots of slots were freed to make the array
+ * dense again.
+ *
  * @param a NftArray descriptor
- * @param s pointer where new free slot will be written to 
- * @result NFT_SUCCESS or NFT_FAILURE 
- * @note Use nft_array_free_slot() if you don't need the slot anymore
+ * @param remap function that gets called for every element that moved
+ *        (after it moved) or NULL
+ * @param userptr arbitrary user pointer passed to remap
+ * @result NFT_SUCCESS or NFT_FAILURE
+ * @note Slots, element pointers and handles of moved elements change (even
+ *       in stable arrays). Use remap to update anything that refers to them.
+ *       Elements are moved with memcpy(), so they must not point to
+ *       themselves.
  */
-NftResult nft_array_slot_alloc(NftArray * a, NftArraySlot * s)
+NftResult nft_array_compact(NftArray * a, NftArrayRemapFunc * remap,
+                            void *userptr)
 {
         if(!a)
                 NFT_LOG_NULL(NFT_FAILURE);
 
+        if(a->flags & NFT_ARRAY_CONCURRENT)
+        {
+                NFT_LOG(L_ERROR, "can't compact concurrent array \"%s\"",
+                        nft_array_get_name(a));
+                return NFT_FAILURE;
+        }
 
-        /* enough space left? */
-        if(a->arraysize <= a->elementcount)
-        {
-                /* increase element descriptor array by NFT_ARRAY_INC elements */
-                if(!(a->elements = realloc(a->elements,
-                                           /* total elements new array can hold 
-                                            */
-                                           (a->arraysize +
-                                            NFT_ARRAY_DEFAULT_INC) *
-                                           /* size of one element descriptor */
-                                           (sizeof(NftElement)))))
-                {
-                        NFT_LOG_PERROR("realloc()");
-                        return NFT_FAILURE;
-                }
-
-                /* increase element buffer by NFT_ARRAY_INC elements */
-                if(!(a->buffer = realloc(a->buffer,
-                                         (a->arraysize +
-                                          NFT_ARRAY_DEFAULT_INC) *
-                                         a->elementsize)))
-                {
-                        NFT_LOG_PERROR("realloc()");
-                        return NFT_FAILURE;
-                }
+        /* keys of pending slots must be indexed before their elements move */
+        if(a->index && !_index_flush(a))
+                return NFT_FAILURE;
 
-                /* clear new memory */
-                memset(&a->elements[a->arraysize],
-                       0, NFT_ARRAY_DEFAULT_INC * sizeof(NftElement));
-                memset(&a->buffer[a->elementsize * a->arraysize],
-                       0, NFT_ARRAY_DEFAULT_INC * a->elementsize);
+        /* move highest element into lowest hole until there are no holes
+         * below elementcount */
+        size_t count = a->elementcount;
+        NftArraySlot to = 0, from = a->used;
+        for(;;)
+        {
+                while(to < count && _is_occupied(a, to))
+                        to++;
 
-                /* remember new arraysize */
-                a->arraysize += NFT_ARRAY_DEFAULT_INC;
-        }
+                if(to >= count)
+                        break;
 
+                /* there's one element >= count for every hole < count */
+                do
+                        from--;
+                while(!_is_occupied(a, from));
 
-        /* find free slot in list */
-        NftArraySlot i;
-        for(i = 0; i < a->arraysize; i++)
-        {
-                if(!a->elements[i].occupied)
-                {
-                        /* set element as occupied */
-                        a->elements[i].occupied = true;
+                void *dst = nft_array_get_element_unchecked(a, to);
+                void *src = nft_array_get_element_unchecked(a, from);
+                memcpy(dst, src, a->elementsize);
+                memset(src, 0, a->elementsize);
 
-                        /* another element allocated... */
-                        a->elementcount++;
+                _set_occupied(a, to, true);
+                _set_occupied(a, from, false);
+                a->elements[to].next = NFT_ARRAY_SLOT_INVALID;
+                a->elements[from].generation++;
 
-                        /* save slot */
-                        *s = i;
+                if(a->index)
+                        _index_move(a, from, to);
 
-                        return NFT_SUCCESS;
-                }
+                if(remap)
+                        remap(dst, from, to, userptr);
         }
 
-        /* huh? */
-        NFT_LOG(L_ERROR,
-                "No free slot found in array \"%s\" but buffer was not increased. Something went wrong! Expect fancy stuff.",
-                nft_array_get_name(a));
+        /* all free slots are behind the last element now */
+        a->freelist = NFT_ARRAY_SLOT_INVALID;
+        a->used = count;
 
-        return NFT_FAILURE;
+        return _resize(a, count);
 }
 
 
@@ -330,11 +1423,49 @@ void nft_array_slot_free(NftArray * a, NftArraySlot s)
         if(!_slot_is_valid(a, s))
                 return;
 
+#ifdef HAVE_BUILTIN_ATOMIC
+        if(a->flags & NFT_ARRAY_CONCURRENT)
+        {
+                _concurrent_slot_free(a, s);
+                return;
+        }
+#endif
+
+        if(!_is_occupied(a, s))
+        {
+                NFT_LOG(L_ERROR,
+                        "tried to free unallocated slot \"%d\" from array \"%s\".",
+                        s, nft_array_get_name(a));
+                return;
+        }
+
+        /* remove element from index */
+        if(a->index)
+        {
+                NftArrayIndex *x = a->index;
+
+                /* element may be pending */
+                size_t p = a->elements[s].next;
+                if(p < x->pendingcount && x->pending[p] == s)
+                {
+                        NftArraySlot last = x->pending[--x->pendingcount];
+                        x->pending[p] = last;
+                        a->elements[last].next = p;
+                }
+                else
+                        _index_remove(a, s);
+        }
+
         /* clear element */
-        memset(&a->buffer[a->elementsize * s], 0, a->elementsize);
+        memset(nft_array_get_element_unchecked(a, s), 0, a->elementsize);
 
-        /* mark element as unused */
-        a->elements[s].occupied = false;
+        /* mark element as unused & invalidate handles to it */
+        _set_occupied(a, s, false);
+        a->elements[s].generation++;
+
+        /* push slot to free-slot list */
+        a->elements[s].next = a->freelist;
+        a->freelist = s;
 
         /* remove one element from array */
         a->elementcount--;
@@ -356,7 +1487,7 @@ void *nft_array_get_element(NftArray * a, NftArraySlot s)
         if(!_slot_is_valid(a, s))
                 return NULL;
 
-        if(!a->elements[s].occupied)
+        if(!_is_occupied(a, s))
         {
                 NFT_LOG(L_ERROR,
                         "requested unallocated slot \"%d\" from array \"%s\".",
@@ -364,7 +1495,77 @@ void *nft_array_get_element(NftArray * a, NftArraySlot s)
                 return NULL;
         }
 
-        return &a->buffer[a->elementsize * s];
+        return nft_array_get_element_unchecked(a, s);
+}
+
+
+/**
+ * get handle of an allocated slot. In contrast to the slot itself, the
+ * handle becomes invalid when the slot is freed and stays invalid when the
+ * slot gets reused, so it can safely be cached.
+ *
+ * @param a NftArray descriptor
+ * @param s allocated slot
+ * @result handle of slot or NFT_ARRAY_HANDLE_INVALID upon error
+ */
+NftArrayHandle nft_array_slot_get_handle(NftArray * a, NftArraySlot s)
+{
+        if(!a)
+                NFT_LOG_NULL(NFT_ARRAY_HANDLE_INVALID);
+
+        if(!_slot_is_valid(a, s))
+                return NFT_ARRAY_HANDLE_INVALID;
+
+        if(!_is_occupied(a, s))
+        {
+                NFT_LOG(L_ERROR,
+                        "requested handle of unallocated slot \"%d\" from array \"%s\".",
+                        s, nft_array_get_name(a));
+                return NFT_ARRAY_HANDLE_INVALID;
+        }
+
+        if(s > NFT_ARRAY_HANDLE_MAX_SLOT)
+        {
+                NFT_LOG(L_ERROR,
+                        "slot \"%d\" of array \"%s\" too large for a handle.",
+                        s, nft_array_get_name(a));
+                return NFT_ARRAY_HANDLE_INVALID;
+        }
+
+        return ((NftArrayHandle) a->elements[s].generation << 32) | s;
+}
+
+
+/**
+ * check if a handle still refers to the element it was created for
+ *
+ * @param a NftArray descriptor
+ * @param h handle from nft_array_slot_get_handle()
+ * @result true if handle is valid, false otherwise
+ */
+bool nft_array_handle_is_valid(NftArray * a, NftArrayHandle h)
+{
+        NftArraySlot s = NFT_ARRAY_HANDLE_SLOT(h);
+
+        return a && s < _NFT_ARRAY_LOAD(&a->used) && _is_occupied(a, s) &&
+                _NFT_ARRAY_LOAD(&a->elements[s].generation) ==
+                (uint32_t) (h >> 32);
+}
+
+
+/**
+ * get element of a handle
+ *
+ * @param a NftArray descriptor
+ * @param h handle from nft_array_slot_get_handle()
+ * @result pointer to element or NULL if handle isn't valid (anymore)
+ */
+void *nft_array_handle_get_element(NftArray * a, NftArrayHandle h)
+{
+        if(!nft_array_handle_is_valid(a, h))
+                return NULL;
+
+        return nft_array_get_element_unchecked(a, NFT_ARRAY_HANDLE_SLOT(h));
 }
 
 
@@ -386,13 +1587,10 @@ NftResult nft_array_foreach_element(NftArray * a,
                 NFT_LOG_NULL(NFT_FAILURE);
 
         NftArraySlot r;
-        for(r = 0; r < a->arraysize; r++)
+        for(r = nft_array_iter_begin(a);
+            r != NFT_ARRAY_SLOT_INVALID; r = nft_array_iter_next(a, r))
         {
-                /* skip empty element */
-                if(!a->elements[r].occupied)
-                        continue;
-
-                if(!(foreach(&a->buffer[a->elementsize * r], userptr)))
+                if(!(foreach(nft_array_get_element_unchecked(a, r), userptr)))
                         return NFT_FAILURE;
         }
 
@@ -424,14 +1622,11 @@ NftResult nft_array_find_slot(NftArray * a,
                 NFT_LOG_NULL(NFT_FAILURE);
 
         NftArraySlot r;
-        for(r = 0; r < a->arraysize; r++)
+        for(r = nft_array_iter_begin(a);
+            r != NFT_ARRAY_SLOT_INVALID; r = nft_array_iter_next(a, r))
         {
-                /* skip empty element */
-                if(!a->elements[r].occupied)
-                        continue;
-
                 /* check if element matches */
-                if(finder(&a->buffer[a->elementsize * r], criterion, userptr))
+                if(finder(nft_array_get_element_unchecked(a, r), criterion, userptr))
                 {
                         *s = r;
                         return NFT_SUCCESS;
@@ -442,6 +1637,170 @@ NftResult nft_array_find_slot(NftArray * a,
 }
 
 
+/**
+ * attach a key index to an array, so elements can be found by their key
+ * with nft_array_find_by_key() in constant time. The index is maintained
+ * by nft_array_slot_alloc() and nft_array_slot_free(). 
+ *
+ * @param a NftArray descriptor
+ * @param key function that returns the key of an element
+ * @param hash function that hashes a key
+ * @param equal function that returns true if two keys are equal
+ * @result NFT_SUCCESS or NFT_FAILURE
+ * @note The key of a freshly allocated element is read on the next
+ *       allocation, free or lookup in the array, so set it right after
+ *       nft_array_slot_alloc(). Keys must not change afterwards.
+ */
+NftResult nft_array_index_enable(NftArray * a,
+                                 NftArrayKeyFunc * key,
+                                 NftArrayHashFunc * hash,
+                                 NftArrayKeyEqualFunc * equal)
+{
+        if(!a || !key || !hash || !equal)
+                NFT_LOG_NULL(NFT_FAILURE);
+
+        if(a->index)
+        {
+                NFT_LOG(L_ERROR, "array \"%s\" already has an index",
+                        nft_array_get_name(a));
+                return NFT_FAILURE;
+        }
+
+        if(a->flags & NFT_ARRAY_CONCURRENT)
+        {
+                NFT_LOG(L_ERROR, "concurrent array \"%s\" can't have an index",
+                        nft_array_get_name(a));
+                return NFT_FAILURE;
+        }
+
+        if(!(a->index = _mem_calloc(a->allocator, 1, sizeof(NftArrayIndex))))
+        {
+                NFT_LOG_PERROR("calloc()");
+                return NFT_FAILURE;
+        }
+
+        a->index->key = key;
+        a->index->hash = hash;
+        a->index->equal = equal;
+
+        /* index elements that are already in the array */
+        NftArraySlot s;
+        for(s = nft_array_iter_begin(a);
+            s != NFT_ARRAY_SLOT_INVALID; s = nft_array_iter_next(a, s))
+        {
+                if(!_index_insert(a, s))
+                {
+                        nft_array_index_disable(a);
+                        return NFT_FAILURE;
+                }
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/**
+ * remove key index from an array
+ *
+ * @param a NftArray descriptor
+ */
+void nft_array_index_disable(NftArray * a)
+{
+        if(!a)
+                NFT_LOG_NULL();
+
+        if(!a->index)
+                return;
+
+        _mem_free(a->allocator, a->index->entries);
+        _mem_free(a->allocator, a->index->pending);
+        _mem_free(a->allocator, a->index);
+        a->index = NULL;
+}
+
+
+/**
+ * find the slot of an element by its key using the index attached by
+ * nft_array_index_enable()
+ *
+ * @param a NftArray descriptor
+ * @param s pointer where slot of found element will be written to
+ * @param key the key to search for
+ * @result NFT_SUCCESS if element was found and slot has been written into *s,
+ *         NFT_FAILURE otherwise
+ */
+NftResult nft_array_find_by_key(NftArray * a, NftArraySlot * s, const void *key)
+{
+        if(!a || !s || !key)
+                NFT_LOG_NULL(NFT_FAILURE);
+
+        NftArrayIndex *x;
+        if(!(x = a->index))
+        {
+                NFT_LOG(L_ERROR, "array \"%s\" has no index",
+                        nft_array_get_name(a));
+                return NFT_FAILURE;
+        }
+
+        if(!_index_flush(a))
+                return NFT_FAILURE;
+
+        if(!x->count)
+                return NFT_FAILURE;
+
+        size_t hash = x->hash(key);
+        size_t e = hash & (x->size - 1);
+        while(x->entries[e].slot != NFT_ARRAY_SLOT_INVALID)
+        {
+                if(x->entries[e].hash == hash &&
+                   x->equal(x->key(nft_array_get_element_unchecked
+                                   (a, x->entries[e].slot)), key))
+                {
+                        *s = x->entries[e].slot;
+                        return NFT_SUCCESS;
+                }
+
+                e = (e + 1) & (x->size - 1);
+        }
+
+        return NFT_FAILURE;
+}
+
+
+/**
+ * NftArrayHashFunc for zero-terminated strings (FNV-1a)
+ *
+ * @param key zero-terminated string
+ * @result hash of string
+ */
+size_t nft_array_hash_string(const void *key)
+{
+        const unsigned char *c = key;
+        uint64_t hash = 14695981039346656037ULL;
+
+        while(*c)
+        {
+                hash ^= *c++;
+                hash *= 1099511628211ULL;
+        }
+
+        return (size_t) hash;
+}
+
+
+/**
+ * NftArrayKeyEqualFunc for zero-terminated strings
+ *
+ * @param a zero-terminated string
+ * @param b zero-terminated string
+ * @result true if both strings are equal
+ */
+bool nft_array_key_equal_string(const void *a, const void *b)
+{
+        return strcmp(a, b) == 0;
+}
+
+
 /**
  * @}
  */
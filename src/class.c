@@ -53,14 +53,29 @@
  */
 
 
+#include <time.h>
 #include <niftylog.h>
 #include "class.h"
 #include "updater.h"
 #include "obj.h"
 #include "prefs.h"
+#include "allocator.h"
+#include "rcu.h"
+#include "config.h"
 
 
 
+/** give up searching a perfect hash seed for a bucket after this many tries */
+#define MAX_SEED 0x1000000
+/** tag in NftPrefsNode->_private: subtree has a class that needs an update
+    (classes are aligned, so the lowest bits of their address are free) */
+#define MIGRATE_TAG ((uintptr_t) 1)
+/** tag in NftPrefsNode->_private: node was seen by _class_resolve_tree() */
+#define RESOLVED_TAG ((uintptr_t) 2)
+/** all tags in NftPrefsNode->_private */
+#define NODE_TAGS (MIGRATE_TAG | RESOLVED_TAG)
+
+
 /** a class of PrefsObjects (e.g. if your object is "Person", 
     you have one "Person" class) */
 struct _NftPrefsClass
@@ -73,27 +88,800 @@ struct _NftPrefsClass
         NftPrefsFromObjFunc *fromObj;
         /** slot of this class inside its NftPrefsClasses array */
         NftArraySlot slot;
-        /** updaters of this class another */
+        /** writer only: updaters of this class sorted by version (s.
+            _updater_add()) */
         NftPrefsUpdaters updaters;
+        /** version of updaters that readers use (s. _updater_publish()) */
+        NftPrefsUpdaterList *list;
+        /** true if updaters may update different nodes at once */
+        bool threadsafe;
+        /** true once the class was unregistered but readers may still use it */
+        bool unregistered;
+        /** performance counters (s. nft_prefs_class_stats_enable()) */
+        NftPrefsClassStats stats;
+};
+
+
+/** version of the class registry that readers look up classes in. Classes
+    are only ever added to a version (s. _snapshot_insert()), writers
+    publish a new version for every other change (s. _publish()). */
+struct _NftPrefsClassSnapshot
+{
+        /** classes by name (open addressing, mask + 1 buckets) */
+        NftPrefsClass **byName;
+        /** byName has mask + 1 buckets */
+        size_t mask;
+        /** amount of classes in byName */
+        size_t count;
+        /** classes by slot (or NULL) */
+        NftPrefsClass **bySlot;
+        /** id of the class in the same slot of bySlot */
+        NftPrefsClassId *ids;
+        /** amount of used entries in bySlot & ids */
+        size_t slots;
+        /** amount of entries bySlot & ids can hold */
+        size_t capacity;
+        /** writer only: versions that were replaced but may still be used by
+            readers (each older one hangs off the garbage of the previous) */
+        NftPrefsClassSnapshot *garbage;
+        /** writer only: class unregistered when this version was replaced */
+        NftPrefsClass *removed;
+};
+
+
+/** minimal perfect hash over the names of all classes of a frozen context
+    (hash & displace: the name's bucket tells how to find its entry) */
+struct _NftPrefsClassTable
+{
+        /** amount of classes */
+        size_t count;
+        /** per bucket (count buckets): seed of the hash that maps the names
+            of this bucket to their entry or -(entry + 1) for buckets holding
+            only one name */
+        int32_t *displacements;
+        /** all classes, ordered by perfect hash */
+        NftPrefsClass **classes;
 };
 
 
 
-/******************************************************************************/
-/**************************** STATIC FUNCTIONS ********************************/
-/******************************************************************************/
+/******************************************************************************/
+/**************************** STATIC FUNCTIONS ********************************/
+/******************************************************************************/
+
+/** fix slot of a class that moved during compaction */
+static void _class_remap(void *element, NftArraySlot from, NftArraySlot to,
+                         void *userptr)
+{
+        ((NftPrefsClass *) element)->slot = to;
+}
+
+
+/** seeded FNV-1a hash of a class name */
+static size_t _name_hash(const char *name, uint32_t seed)
+{
+        uint64_t h = 14695981039346656037ULL ^ ((uint64_t) seed *
+                                                0x9e3779b97f4a7c15ULL);
+        for(; *name; name++)
+        {
+                h ^= (unsigned char) *name;
+                h *= 1099511628211ULL;
+        }
+
+        /* mix high bits into low bits since callers use h % n */
+        h ^= h >> 29;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 32;
+
+        return (size_t) h;
+}
+
+
+/** find class in frozen registry */
+static NftPrefsClass *_table_find(NftPrefsClassTable * t, const char *name)
+{
+        if(!t->count)
+                return NULL;
+
+        int32_t d = t->displacements[_name_hash(name, 0) % t->count];
+        size_t e = d < 0 ? (size_t) (-d - 1) : _name_hash(name, d) % t->count;
+
+        /* unknown names land on arbitrary entries */
+        NftPrefsClass *klass = t->classes[e];
+        return strcmp(klass->name, name) == 0 ? klass : NULL;
+}
+
+
+/**
+ * find seed that maps all names of a bucket to distinct free entries
+ *
+ * @param t table being built
+ * @param names classes of this bucket
+ * @param n amount of classes in bucket
+ * @param taken entries already used by other buckets
+ * @param entries space for n entries
+ * @result seed or 0 upon failure
+ */
+static uint32_t _table_seed(NftPrefsClassTable * t, NftPrefsClass ** names,
+                            size_t n, bool *taken, size_t *entries)
+{
+        uint32_t seed;
+        for(seed = 1; seed < MAX_SEED; seed++)
+        {
+                size_t i;
+                for(i = 0; i < n; i++)
+                {
+                        entries[i] = _name_hash(names[i]->name, seed) % t->count;
+                        if(taken[entries[i]])
+                                break;
+
+                        /* names of one bucket must not collide either */
+                        size_t j;
+                        for(j = 0; j < i && entries[j] != entries[i]; j++);
+                        if(j < i)
+                                break;
+                }
+
+                if(i == n)
+                        return seed;
+        }
+
+        return 0;
+}
+
+
+/**
+ * build minimal perfect hash over all registered classes
+ *
+ * @param p NftPrefs context
+ * @param t empty table
+ * @result NFT_SUCCESS or NFT_FAILURE
+ */
+static NftResult _table_build(NftPrefs * p, NftPrefsClassTable * t)
+{
+        const NftAllocator *al = _prefs_allocator(p);
+        NftPrefsClasses *classes = _prefs_classes(p);
+        size_t n = t->count;
+        NftResult r = NFT_FAILURE;
+
+        /* scratch space */
+        size_t *bucket = _mem_alloc(al, n * sizeof(size_t));
+        size_t *start = _mem_calloc(al, n + 1, sizeof(size_t));
+        NftPrefsClass **sorted = _mem_alloc(al, n * sizeof(NftPrefsClass *));
+        size_t *order = _mem_alloc(al, n * sizeof(size_t));
+        bool *taken = _mem_calloc(al, n, sizeof(bool));
+        size_t *entries = _mem_alloc(al, n * sizeof(size_t));
+        if(!bucket || !start || !sorted || !order || !taken || !entries)
+        {
+                NFT_LOG_PERROR("malloc()");
+                goto _tb_exit;
+        }
+
+        /* sort classes by bucket (counting sort) */
+        size_t i = 0;
+        NftArraySlot s;
+        NftPrefsClass *klass;
+        NFT_ARRAY_FOREACH(classes, s, klass)
+        {
+                bucket[i] = _name_hash(klass->name, 0) % n;
+                start[bucket[i] + 1]++;
+                i++;
+        }
+        for(i = 0; i < n; i++)
+                start[i + 1] += start[i];
+
+        size_t *fill = entries;
+        memcpy(fill, start, n * sizeof(size_t));
+        i = 0;
+        NFT_ARRAY_FOREACH(classes, s, klass)
+        {
+                sorted[fill[bucket[i]]++] = klass;
+                i++;
+        }
+
+        /* handle large buckets first (counting sort by bucket size) */
+        size_t largest = 0, b;
+        for(b = 0; b < n; b++)
+        {
+                if(start[b + 1] - start[b] > largest)
+                        largest = start[b + 1] - start[b];
+        }
+
+        size_t o = 0, size;
+        for(size = largest; size > 0; size--)
+        {
+                for(b = 0; b < n; b++)
+                {
+                        if(start[b + 1] - start[b] == size)
+                                order[o++] = b;
+                }
+        }
+
+        /* place buckets */
+        size_t next = 0;
+        for(i = 0; i < o; i++)
+        {
+                b = order[i];
+                size = start[b + 1] - start[b];
+
+                /* single names take the next free entry directly */
+                if(size == 1)
+                {
+                        while(taken[next])
+                                next++;
+
+                        taken[next] = true;
+                        t->classes[next] = sorted[start[b]];
+                        t->displacements[b] = -(int32_t) next - 1;
+                        continue;
+                }
+
+                uint32_t seed;
+                if(!(seed = _table_seed(t, &sorted[start[b]], size, taken,
+                                        entries)))
+                {
+                        NFT_LOG(L_ERROR,
+                                "failed to find perfect hash for %d classes",
+                                (int) n);
+                        goto _tb_exit;
+                }
+
+                size_t k;
+                for(k = 0; k < size; k++)
+                {
+                        taken[entries[k]] = true;
+                        t->classes[entries[k]] = sorted[start[b] + k];
+                }
+                t->displacements[b] = (int32_t) seed;
+        }
+
+        r = NFT_SUCCESS;
+
+_tb_exit:
+        _mem_free(al, bucket);
+        _mem_free(al, start);
+        _mem_free(al, sorted);
+        _mem_free(al, order);
+        _mem_free(al, taken);
+        _mem_free(al, entries);
+        return r;
+}
+
+
+/** cache class of all element nodes in node, its siblings & children. Tags
+    nodes that have a class of set migrate somewhere in their subtree */
+static bool _resolve_nodes(NftPrefs * p, NftPrefsNode * node,
+                           const NftPrefsClassSet * migrate)
+{
+        bool found = false;
+
+        NftPrefsNode *n;
+        for(n = node; n; n = n->next)
+        {
+                if(n->type != XML_ELEMENT_NODE)
+                        continue;
+
+                NftPrefsClass *klass =
+                        _class_find_by_name(p, (const char *) n->name);
+
+                bool tag = _class_in_set(migrate, klass);
+                if(n->children && _resolve_nodes(p, n->children, migrate))
+                        tag = true;
+
+                n->_private = (void *) ((uintptr_t) klass | RESOLVED_TAG |
+                                        (tag ? MIGRATE_TAG : 0));
+                found |= tag;
+        }
+
+        return found;
+}
+
+
+/** free one version of the registry */
+static void _snapshot_free(NftPrefs * p, NftPrefsClassSnapshot * s)
+{
+        const NftAllocator *al = _prefs_allocator(p);
+        _mem_free(al, s->byName);
+        _mem_free(al, s->bySlot);
+        _mem_free(al, s->ids);
+        _mem_free(al, s);
+}
+
+
+/** create version of the registry containing all registered classes */
+static NftPrefsClassSnapshot *_snapshot_build(NftPrefs * p)
+{
+        const NftAllocator *al = _prefs_allocator(p);
+        NftPrefsClasses *classes = _prefs_classes(p);
+
+        /* count classes */
+        size_t count = 0, slots = 0;
+        NftArraySlot s;
+        NftPrefsClass *klass;
+        NFT_ARRAY_FOREACH(classes, s, klass)
+        {
+                if(klass->unregistered)
+                        continue;
+
+                count++;
+                slots = s + 1;
+        }
+
+        /* keep hash at most half full, even after as many classes were
+           added again (s. _snapshot_insert()) */
+        size_t buckets = 1;
+        while(buckets < count * 4)
+                buckets <<= 1;
+
+        size_t capacity = slots < 8 ? 16 : slots * 2;
+
+        NftPrefsClassSnapshot *n;
+        if(!(n = _mem_calloc(al, 1, sizeof(NftPrefsClassSnapshot))))
+        {
+                NFT_LOG_PERROR("calloc()");
+                return NULL;
+        }
+
+        n->mask = buckets - 1;
+        n->count = count;
+        n->slots = slots;
+        n->capacity = capacity;
+        if(!(n->byName = _mem_calloc(al, buckets, sizeof(NftPrefsClass *))) ||
+           !(n->bySlot = _mem_calloc(al, capacity, sizeof(NftPrefsClass *))) ||
+           !(n->ids = _mem_calloc(al, capacity, sizeof(NftPrefsClassId))))
+        {
+                NFT_LOG_PERROR("calloc()");
+                _snapshot_free(p, n);
+                return NULL;
+        }
+
+        NFT_ARRAY_FOREACH(classes, s, klass)
+        {
+                if(klass->unregistered)
+                        continue;
+
+                size_t i;
+                for(i = nft_array_hash_string(klass->name) & n->mask;
+                    n->byName[i]; i = (i + 1) & n->mask);
+                n->byName[i] = klass;
+
+                n->bySlot[s] = klass;
+                n->ids[s] = nft_array_slot_get_handle(classes, s);
+        }
+
+        return n;
+}
+
+
+/** find class in one version of the registry */
+static NftPrefsClass *_snapshot_find(NftPrefsClassSnapshot * n,
+                                     const char *name)
+{
+        if(!n)
+                return NULL;
+
+        size_t i;
+        NftPrefsClass *klass;
+        for(i = nft_array_hash_string(name) & n->mask;
+            (klass = _RCU_DEREFERENCE(&n->byName[i])); i = (i + 1) & n->mask)
+        {
+                if(strcmp(klass->name, name) == 0)
+                        return klass;
+        }
+
+        return NULL;
+}
+
+
+/**
+ * add a freshly registered class to the current version of the registry
+ * (call with write lock held). Readers see the class as soon as they find
+ * it, so no new version needs to be published & nobody needs to wait.
+ *
+ * @param p NftPrefs context
+ * @param klass new class
+ * @result true if class was added, false if the current version is full
+ */
+static bool _snapshot_insert(NftPrefs * p, NftPrefsClass * klass)
+{
+        NftPrefsClassSnapshot *n;
+        if(!(n = _prefs_class_snapshot(p)) ||
+           (n->count + 1) * 2 > n->mask + 1 || klass->slot >= n->capacity)
+                return false;
+
+        /* class must be complete before readers can find it by id... */
+        NftArraySlot s = klass->slot;
+        _RCU_ASSIGN(&n->bySlot[s], klass);
+        _RCU_ASSIGN(&n->ids[s], nft_array_slot_get_handle(_prefs_classes(p),
+                                                          s));
+        if(s >= n->slots)
+                _RCU_ASSIGN(&n->slots, s + 1);
+
+        /* ...or by name */
+        size_t i;
+        for(i = nft_array_hash_string(klass->name) & n->mask; n->byName[i];
+            i = (i + 1) & n->mask);
+        _RCU_ASSIGN(&n->byName[i], klass);
+        n->count++;
+
+        return true;
+}
+
+
+/** free all versions that were replaced by n (& classes they removed) */
+static void _reclaim(NftPrefs * p, NftPrefsClassSnapshot * n)
+{
+        NftPrefsClassSnapshot *g, *next;
+        for(g = n->garbage; g; g = next)
+        {
+                next = g->garbage;
+                if(g->removed)
+                        _class_free(p, g->removed);
+                _snapshot_free(p, g);
+        }
+
+        n->garbage = NULL;
+}
+
+
+/**
+ * publish new version of the registry after classes were changed (call with
+ * write lock held). The old version is freed once no reader uses it anymore.
+ *
+ * @param p NftPrefs context
+ * @param removed class that was unregistered or NULL
+ * @result NFT_SUCCESS or NFT_FAILURE
+ */
+static NftResult _publish(NftPrefs * p, NftPrefsClass * removed)
+{
+        NftPrefsClassSnapshot *old = _prefs_class_snapshot(p), *n;
+        if(!(n = _snapshot_build(p)))
+                return NFT_FAILURE;
+
+        if(old)
+        {
+                old->removed = removed;
+                n->garbage = old;
+        }
+
+        _prefs_set_class_snapshot(p, n);
+
+        /* free old versions if readers are done with them (otherwise the
+           next writer will) */
+        if(_rcu_synchronize(_prefs_rcu(p)))
+                _reclaim(p, n);
+
+        return NFT_SUCCESS;
+}
+
+
+/** free all replaced versions of the registry now or fail (call with write
+    lock held) */
+static NftResult _reclaim_all(NftPrefs * p)
+{
+        NftPrefsClassSnapshot *n;
+        if(!(n = _prefs_class_snapshot(p)) || !n->garbage)
+                return NFT_SUCCESS;
+
+        if(!_rcu_synchronize(_prefs_rcu(p)))
+        {
+                NFT_LOG(L_ERROR,
+                        "can't wait for readers of the class registry from inside a reader");
+                return NFT_FAILURE;
+        }
+
+        _reclaim(p, n);
+
+        return NFT_SUCCESS;
+}
+
+
+/** add to a counter that may be updated by many threads at once */
+static void _counter_add(uint64_t * c, uint64_t v)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        __atomic_add_fetch(c, v, __ATOMIC_RELAXED);
+#else
+        *c += v;
+#endif
+}
+
+
+/** raise a counter that may be updated by many threads at once to v */
+static void _counter_max(uint64_t * c, uint64_t v)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        uint64_t old = __atomic_load_n(c, __ATOMIC_RELAXED);
+        while(v > old &&
+              !__atomic_compare_exchange_n(c, &old, v, true, __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED));
+#else
+        if(v > *c)
+                *c = v;
+#endif
+}
+
+
+/** read a counter that may be updated by many threads at once */
+static uint64_t _counter_get(uint64_t * c)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        return __atomic_load_n(c, __ATOMIC_RELAXED);
+#else
+        return *c;
+#endif
+}
+
+
+/** copy call statistics (s. _counter_get()) */
+static void _call_stats_get(NftPrefsCallStats * s, NftPrefsCallStats * copy)
+{
+        copy->calls = _counter_get(&s->calls);
+        copy->failures = _counter_get(&s->failures);
+        copy->totalNs = _counter_get(&s->totalNs);
+        copy->maxNs = _counter_get(&s->maxNs);
+}
+
+
+/** current monotonic time in nanoseconds */
+static uint64_t _now_ns(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (uint64_t) t.tv_sec * 1000000000ULL + (uint64_t) t.tv_nsec;
+}
+
+
+/** amount of element nodes in a tree */
+static uint64_t _count_nodes(NftPrefsNode * node)
+{
+        uint64_t count = 1;
+
+        NftPrefsNode *n;
+        for(n = node->children; n; n = n->next)
+        {
+                if(n->type == XML_ELEMENT_NODE)
+                        count += _count_nodes(n);
+        }
+
+        return count;
+}
+
+
+/** initialize a freshly allocated class */
+static NftResult _class_setup(NftPrefs * p, NftPrefsClass * klass,
+                              NftArraySlot s, const char *className,
+                              NftPrefsToObjFunc * toObj,
+                              NftPrefsFromObjFunc * fromObj)
+{
+        /* allocate new array for updater functions */
+        if(!_updater_init_array(&klass->updaters, _prefs_allocator(p)))
+        {
+                NFT_LOG(L_ERROR, "Failed to init updater array");
+                return NFT_FAILURE;
+        }
+
+        strncpy(klass->name, className, NFT_PREFS_MAX_CLASSNAME);
+        klass->name[NFT_PREFS_MAX_CLASSNAME] = '\0';
+        klass->toObj = toObj;
+        klass->fromObj = fromObj;
+        klass->slot = s;
+        klass->list = NULL;
+        klass->threadsafe = false;
+        klass->unregistered = false;
+        memset(&klass->stats, 0, sizeof(klass->stats));
+
+        return NFT_SUCCESS;
+}
+
+
+/** register class (call with write lock held) */
+static NftResult _class_register(NftPrefs * p, const char *className,
+                                 NftPrefsToObjFunc * toObj,
+                                 NftPrefsFromObjFunc * fromObj)
+{
+        if(_prefs_is_frozen(p))
+                return NFT_FAILURE;
+
+        /* check if class is already registered */
+        NFT_LOG(L_DEBUG,
+                "Checking if another class \"%s\" is already registered...",
+                className);
+        if(_class_find_by_name(p, className))
+        {
+                NFT_LOG(L_ERROR, "class named \"%s\" already registered",
+                        className);
+                return NFT_FAILURE;
+        }
+
+        /* allocate new slot in class array */
+        NftArraySlot s;
+        if(!(nft_array_slot_alloc(_prefs_classes(p), &s)))
+        {
+                NFT_LOG(L_ERROR, "Failed to allocate new array slot");
+                return NFT_FAILURE;
+        }
+
+        /* get empty array element */
+        NftPrefsClass *n;
+        if(!(n = nft_array_get_element(_prefs_classes(p), s)))
+        {
+                NFT_LOG(L_ERROR, "Failed to get element from array slot");
+                goto _pcr_error;
+        }
+
+        /* register new class */
+        if(!_class_setup(p, n, s, className, toObj, fromObj))
+                goto _pcr_error;
+
+        /* make class visible to readers */
+        if(!_snapshot_insert(p, n) && !_publish(p, NULL))
+        {
+                nft_array_deinit(&n->updaters);
+                goto _pcr_error;
+        }
+
+        return NFT_SUCCESS;
+
+_pcr_error:
+        nft_array_slot_free(_prefs_classes(p), s);
+        return NFT_FAILURE;
+}
+
+
+
+/** check a NftPrefsClassDesc table before registering it */
+static NftResult _table_check(NftPrefs * p, const NftPrefsClassDesc * table,
+                              size_t n, size_t *names, size_t mask)
+{
+        NftPrefsClassSnapshot *current = _prefs_class_snapshot(p);
+
+        size_t i;
+        for(i = 0; i < n; i++)
+        {
+                const NftPrefsClassDesc *d = &table[i];
+                if(!d->name || strlen(d->name) == 0)
+                {
+                        NFT_LOG(L_ERROR, "class name may not be empty");
+                        return NFT_FAILURE;
+                }
+
+                size_t u;
+                for(u = 0; u < d->updaterCount; u++)
+                {
+                        if(!d->updaters || !d->updaters[u].updater)
+                        {
+                                NFT_LOG(L_ERROR,
+                                        "updater %d of class \"%s\" is NULL",
+                                        (int) u, d->name);
+                                return NFT_FAILURE;
+                        }
+                }
+
+                if(_snapshot_find(current, d->name))
+                {
+                        NFT_LOG(L_ERROR,
+                                "class named \"%s\" already registered",
+                                d->name);
+                        return NFT_FAILURE;
+                }
+
+                /* remember name to find duplicates inside table */
+                size_t h;
+                for(h = nft_array_hash_string(d->name) & mask;
+                    names[h] != (size_t) -1; h = (h + 1) & mask)
+                {
+                        if(strcmp(table[names[h]].name, d->name) == 0)
+                        {
+                                NFT_LOG(L_ERROR,
+                                        "class named \"%s\" listed twice",
+                                        d->name);
+                                return NFT_FAILURE;
+                        }
+                }
+                names[h] = i;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/** register table of classes (call with write lock held) */
+static NftResult _class_register_table(NftPrefs * p,
+                                       const NftPrefsClassDesc * table,
+                                       size_t n)
+{
+        if(_prefs_is_frozen(p))
+                return NFT_FAILURE;
+
+        const NftAllocator *al = _prefs_allocator(p);
+        NftPrefsClasses *classes = _prefs_classes(p);
+        NftResult r = NFT_FAILURE;
+
+        /* scratch space: hash of table indices by name & new slots */
+        size_t buckets = 1;
+        while(buckets < n * 2)
+                buckets <<= 1;
+
+        size_t *names = _mem_alloc(al, buckets * sizeof(size_t));
+        NftArraySlot *slots = _mem_alloc(al, n * sizeof(NftArraySlot));
+        if(!names || !slots)
+        {
+                NFT_LOG_PERROR("malloc()");
+                goto _crt_exit;
+        }
+        memset(names, 0xff, buckets * sizeof(size_t));
 
-/** finder for nft_array_find_slot() */
-static bool _find_by_name(void *element, void *criterion, void *userptr)
-{
-        if(!element || !criterion)
-                NFT_LOG_NULL(false);
+        if(!_table_check(p, table, n, names, buckets - 1))
+                goto _crt_exit;
+
+        /* allocate all classes at once */
+        if(!nft_array_slot_alloc_n(classes, n, slots))
+        {
+                NFT_LOG(L_ERROR, "Failed to allocate %d array slots", (int) n);
+                goto _crt_exit;
+        }
+
+        size_t i, set;
+        for(set = 0; set < n; set++)
+        {
+                const NftPrefsClassDesc *d = &table[set];
+                NftPrefsClass *klass =
+                        nft_array_get_element_unchecked(classes, slots[set]);
+
+                if(!_class_setup(p, klass, slots[set], d->name, d->toObj,
+                                 d->fromObj))
+                        goto _crt_rollback;
+                klass->threadsafe = d->threadsafe;
+
+                if(d->updaterCount &&
+                   !nft_array_reserve(&klass->updaters, d->updaterCount))
+                {
+                        set++;
+                        goto _crt_rollback;
+                }
+
+                size_t u;
+                for(u = 0; u < d->updaterCount; u++)
+                {
+                        if(!_updater_add(klass, d->updaters[u].updater,
+                                         d->updaters[u].version,
+                                         d->updaters[u].userptr))
+                        {
+                                set++;
+                                goto _crt_rollback;
+                        }
+                }
+
+                if(d->updaterCount && !_updater_publish(p, klass))
+                {
+                        set++;
+                        goto _crt_rollback;
+                }
+        }
 
+        /* make all classes visible to readers at once */
+        if(_publish(p, NULL))
+        {
+                r = NFT_SUCCESS;
+                goto _crt_exit;
+        }
 
-        NftPrefsClass *c = element;
-        const char *name = criterion;
+_crt_rollback:
+        for(i = 0; i < set; i++)
+        {
+                NftPrefsClass *klass =
+                        nft_array_get_element_unchecked(classes, slots[i]);
+                _updater_list_free(p, klass->list);
+                nft_array_deinit(&klass->updaters);
+        }
+        for(i = 0; i < n; i++)
+                nft_array_slot_free(classes, slots[i]);
 
-        return (strcmp(c->name, name) == 0);
+_crt_exit:
+        _mem_free(al, names);
+        _mem_free(al, slots);
+        return r;
 }
 
 
@@ -103,26 +891,50 @@ static bool _find_by_name(void *element, void *criterion, void *userptr)
 /******************************************************************************/
 
 /** initialize class array */
-NftResult _class_init_array(NftPrefsClasses * a)
+NftResult _class_init_array(NftPrefsClasses * a, const NftAllocator * allocator)
+{
+        /* initialize class-array (classes never move, so NftPrefsClass
+         * pointers stay valid until the class is unregistered) */
+        if(!nft_array_init_stable(a, sizeof(NftPrefsClass)))
+                return NFT_FAILURE;
+
+        /* classes are looked up in NftPrefsClassSnapshots, not in the
+           array itself (s. _publish()) */
+        return nft_array_set_allocator(a, allocator);
+}
+
+
+/** free all versions of the class registry of a context (no reader may be
+    left) */
+void _class_registry_free(NftPrefs * p)
 {
-        /* initialize class-array */
-        return nft_array_init(a, sizeof(NftPrefsClass));
+        NftPrefsClassSnapshot *n;
+        if(!(n = _prefs_class_snapshot(p)))
+                return;
+
+        _reclaim(p, n);
+        _snapshot_free(p, n);
+        _prefs_set_class_snapshot(p, NULL);
 }
 
 
 /** find class by name */
-NftPrefsClass *_class_find_by_name(NftPrefsClasses * c, const char *name)
+NftPrefsClass *_class_find_by_name(NftPrefs * p, const char *name)
 {
-        /* find class in array */
-        NftArraySlot slot;
-        if(!nft_array_find_slot
-           (c, &slot, _find_by_name, (void *) name, NULL))
+        /* frozen registry? */
+        NftPrefsClassTable *t;
+        if((t = _prefs_class_table(p)))
+                return _table_find(t, name);
+
+        /* find class in current version of registry */
+        NftPrefsClass *klass;
+        if(!(klass = _snapshot_find(_prefs_class_snapshot(p), name)))
         {
                 NFT_LOG(L_DEBUG, "Class \"%s\" not found", name);
                 return NULL;
         }
 
-        return nft_array_get_element(c, slot);
+        return klass;
 }
 
 
@@ -132,7 +944,9 @@ void _class_free(NftPrefs * p, NftPrefsClass * klass)
         if(!klass)
                 return;
 
-        /* free updater array */
+        /* free updater array & plans */
+        _updater_list_free(p, klass->list);
+        klass->list = NULL;
         nft_array_deinit(&klass->updaters);
 
         /* free array slot */
@@ -145,6 +959,237 @@ void _class_free(NftPrefs * p, NftPrefsClass * klass)
 }
 
 
+/** find class by its id (NULL if class was unregistered or moved) */
+NftPrefsClass *_class_find_by_id(NftPrefs * p, NftPrefsClassId id)
+{
+        NftPrefsClassSnapshot *n;
+        if(!(n = _prefs_class_snapshot(p)))
+                return NULL;
+
+        NftArraySlot s = NFT_ARRAY_HANDLE_SLOT(id);
+        if(s >= _RCU_DEREFERENCE(&n->slots) ||
+           _RCU_DEREFERENCE(&n->ids[s]) != id)
+                return NULL;
+
+        return _RCU_DEREFERENCE(&n->bySlot[s]);
+}
+
+
+/** freeze class registry of a context (s. nft_prefs_freeze(), call with
+    write lock held) */
+NftResult _class_freeze(NftPrefs * p)
+{
+        const NftAllocator *al = _prefs_allocator(p);
+        NftPrefsClasses *classes = _prefs_classes(p);
+
+        /* get rid of unregistered classes */
+        if(!_reclaim_all(p))
+                return NFT_FAILURE;
+
+        NftPrefsClassTable *t;
+        if(!(t = _mem_calloc(al, 1, sizeof(NftPrefsClassTable))))
+        {
+                NFT_LOG_PERROR("calloc()");
+                return NFT_FAILURE;
+        }
+
+        t->count = nft_array_get_elementcount(classes);
+        if(t->count)
+        {
+                if(!(t->displacements = _mem_calloc(al, t->count,
+                                                    sizeof(int32_t))) ||
+                   !(t->classes = _mem_calloc(al, t->count,
+                                              sizeof(NftPrefsClass *))))
+                {
+                        NFT_LOG_PERROR("calloc()");
+                        goto _cf_error;
+                }
+
+                if(!_table_build(p, t))
+                        goto _cf_error;
+        }
+
+        _prefs_set_class_table(p, t);
+
+        return NFT_SUCCESS;
+
+_cf_error:
+        _mem_free(al, t->displacements);
+        _mem_free(al, t->classes);
+        _mem_free(al, t);
+        return NFT_FAILURE;
+}
+
+
+/** release frozen class registry of a context */
+void _class_table_free(NftPrefs * p)
+{
+        NftPrefsClassTable *t;
+        if(!(t = _prefs_class_table(p)))
+                return;
+
+        const NftAllocator *al = _prefs_allocator(p);
+        _mem_free(al, t->displacements);
+        _mem_free(al, t->classes);
+        _mem_free(al, t);
+
+        _prefs_set_class_table(p, NULL);
+}
+
+
+/**
+ * resolve class of every node of a freshly parsed document once, so later
+ * conversions & updates don't need to look up classes by name
+ *
+ * @param p NftPrefs context
+ * @param node root node of document
+ * @param migrate classes that need an update or NULL
+ * @result true if a node of a class in migrate was found
+ * @note libxml2's _private pointers of the document and its nodes are used
+ *       for this. The cache is ignored once the registry of p changes.
+ *       Nodes on the path to a class of migrate are tagged until then
+ *       (s. _class_node_migrates())
+ */
+bool _class_resolve_tree(NftPrefs * p, NftPrefsNode * node,
+                         const NftPrefsClassSet * migrate)
+{
+        if(node->doc)
+                node->doc->_private = (void *) _prefs_epoch(p);
+
+        return _resolve_nodes(p, node, migrate);
+}
+
+
+/** resolve children of a node again after updaters changed them (s.
+    _class_resolve_tree()) */
+bool _class_resolve_children(NftPrefs * p, NftPrefsNode * node,
+                             const NftPrefsClassSet * migrate)
+{
+        return node->children && _resolve_nodes(p, node->children, migrate);
+}
+
+
+/** check if node or one of its children had a class that needs an update
+    when _class_resolve_tree() ran (nodes created later may need one, too) */
+bool _class_node_migrates(NftPrefsNode * n)
+{
+        uintptr_t tags = (uintptr_t) n->_private & NODE_TAGS;
+        return (tags & MIGRATE_TAG) || !(tags & RESOLVED_TAG);
+}
+
+
+/** check if class is in a set (classes registered after the set was
+    created are treated as members) */
+bool _class_in_set(const NftPrefsClassSet * set, NftPrefsClass * c)
+{
+        if(!set || !c)
+                return false;
+
+        if(c->slot >= set->slots)
+                return true;
+
+        return (set->bits[c->slot / 64] >> (c->slot % 64)) & 1;
+}
+
+
+/** drop classes cached in node & its children (e.g. when moved to another
+    document) */
+void _class_forget_tree(NftPrefsNode * node)
+{
+        node->_private = NULL;
+
+        NftPrefsNode *n;
+        for(n = node->children; n; n = n->next)
+        {
+                if(n->type == XML_ELEMENT_NODE)
+                        _class_forget_tree(n);
+        }
+}
+
+
+/** get class cached for a node while parsing without checking its name
+    (NULL if nothing valid is cached) */
+NftPrefsClass *_class_cached(NftPrefs * p, NftPrefsNode * n)
+{
+        /* cache of this document valid for this registry? */
+        if(!n->doc || n->doc->_private != (void *) _prefs_epoch(p))
+                return NULL;
+
+        return (NftPrefsClass *) ((uintptr_t) n->_private & ~NODE_TAGS);
+}
+
+
+/** get class of a node (from cache if possible) */
+NftPrefsClass *_class_of_node(NftPrefs * p, NftPrefsNode * n)
+{
+        /* cache of this document valid for this registry? */
+        bool cached = n->doc &&
+                n->doc->_private == (void *) _prefs_epoch(p);
+
+        /* nodes renamed or created after parsing aren't cached (correctly) */
+        NftPrefsClass *klass;
+        if((klass = _class_cached(p, n)) &&
+           strcmp(klass->name, (const char *) n->name) == 0)
+                return klass;
+
+        klass = _class_find_by_name(p, (const char *) n->name);
+        if(cached)
+                n->_private = (void *) ((uintptr_t) klass |
+                                        ((uintptr_t) n->_private & NODE_TAGS));
+
+        return klass;
+}
+
+
+/** getter */
+NftPrefsClassStats *_class_stats(NftPrefsClass * c)
+{
+        return &c->stats;
+}
+
+
+/** start timing a callback (returns 0 if statistics are disabled) */
+uint64_t _class_stats_start(NftPrefs * p)
+{
+        if(!_prefs_stats_enabled(p))
+                return 0;
+
+        /* never 0 */
+        return _now_ns() + 1;
+}
+
+
+/** count a finished callback that was started by _class_stats_start() */
+void _class_stats_end(NftPrefsCallStats * s, uint64_t start, NftResult r)
+{
+        if(!start)
+                return;
+
+        uint64_t ns = _now_ns() + 1 - start;
+
+        _counter_add(&s->calls, 1);
+        if(!r)
+                _counter_add(&s->failures, 1);
+        _counter_add(&s->totalNs, ns);
+        _counter_max(&s->maxNs, ns);
+}
+
+
+/** count nodes produced by a NftPrefsFromObjFunc (if statistics are
+    enabled) */
+void _class_stats_nodes(NftPrefsClass * c, NftPrefsNode * node)
+{
+        _counter_add(&c->stats.nodes, _count_nodes(node));
+}
+
+
+/** getter */
+const char *_class_name(NftPrefsClass * c)
+{
+        return c->name;
+}
+
+
 /** getter */
 NftPrefsFromObjFunc *_class_fromObj(NftPrefsClass * c)
 {
@@ -166,6 +1211,46 @@ NftPrefsUpdaters *_class_updaters(NftPrefsClass * c)
 }
 
 
+/** amount of class slots of the current registry (call inside read-side
+    critical section) */
+size_t _class_slots(NftPrefs * p)
+{
+        NftPrefsClassSnapshot *n = _prefs_class_snapshot(p);
+        return n ? _RCU_DEREFERENCE(&n->slots) : 0;
+}
+
+
+/** class in slot of the current registry or NULL (call inside read-side
+    critical section) */
+NftPrefsClass *_class_at(NftPrefs * p, NftArraySlot s)
+{
+        NftPrefsClassSnapshot *n = _prefs_class_snapshot(p);
+        return n && s < _RCU_DEREFERENCE(&n->slots) ?
+                _RCU_DEREFERENCE(&n->bySlot[s]) : NULL;
+}
+
+
+/** getter */
+NftPrefsUpdaterList **_class_updater_list(NftPrefsClass * c)
+{
+        return &c->list;
+}
+
+
+/** getter */
+bool _class_threadsafe(NftPrefsClass * c)
+{
+        return c->threadsafe;
+}
+
+
+/** setter (call with write lock held) */
+void _class_set_threadsafe(NftPrefsClass * c, bool threadsafe)
+{
+        c->threadsafe = threadsafe;
+}
+
+
 
 /******************************************************************************/
 /**************************** API FUNCTIONS ***********************************/
@@ -179,6 +1264,11 @@ NftPrefsUpdaters *_class_updaters(NftPrefsClass * c)
  * @param toObj pointer to NftPrefsToObjFunc used by the new class
  * @param fromObj pointer to NftPrefsFromObjFunc used by the new class
  * @result NFT_SUCCESS or NFT_FAILURE
+ * @note Classes may be registered & unregistered while other threads
+ *       convert objects & nodes of p. Lookups never wait for this.
+ * @note A new class usually just gets added to the lookup tables of the
+ *       registry. Every now and then they are rebuilt with room for as many
+ *       classes again, so registering n classes takes O(n) time in total.
  */
 NftResult nft_prefs_class_register(NftPrefs * p, const char *className,
                                    NftPrefsToObjFunc * toObj,
@@ -194,81 +1284,216 @@ NftResult nft_prefs_class_register(NftPrefs * p, const char *className,
                 return NFT_FAILURE;
         }
 
-        /* check if class is already registered */
-        NFT_LOG(L_DEBUG,
-                "Checking if another class \"%s\" is already registered...",
-                className);
-        if(_class_find_by_name(_prefs_classes(p), className))
-        {
-                NFT_LOG(L_ERROR, "class named \"%s\" already registered",
-                        className);
-                return NFT_FAILURE;
-        }
+        _rcu_write_lock(_prefs_rcu(p));
+        NftResult r = _class_register(p, className, toObj, fromObj);
+        _rcu_write_unlock(_prefs_rcu(p));
 
-        /* allocate new slot in class array */
-        NftArraySlot s;
-        if(!(nft_array_slot_alloc(_prefs_classes(p), &s)))
-        {
-                NFT_LOG(L_ERROR, "Failed to allocate new array slot");
-                return NFT_FAILURE;
-        }
+        return r;
+}
 
-        /* get empty array element */
-        NftPrefsClass *n;
-        if(!(n = nft_array_get_element(_prefs_classes(p), s)))
-        {
-                NFT_LOG(L_ERROR, "Failed to get element from array slot");
-                goto _pcr_error;
-        }
 
-        /* allocate new array for updater functions */
-        if(!_updater_init_array(&n->updaters))
+/**
+ * register many classes at once. This checks for duplicates in one pass,
+ * allocates all classes at once and makes them visible to other threads at
+ * once, so it's a lot faster than calling nft_prefs_class_register() &
+ * nft_prefs_updater_register() for every class.
+ *
+ * @param p NftPrefs context where new classes should be registered to
+ * @param table descriptions of the new classes
+ * @param n amount of entries in table
+ * @result NFT_SUCCESS or NFT_FAILURE (no class is registered then)
+ */
+NftResult nft_prefs_class_register_table(NftPrefs * p,
+                                         const NftPrefsClassDesc * table,
+                                         size_t n)
+{
+        if(!p || (n && !table))
+                NFT_LOG_NULL(NFT_FAILURE);
+
+        if(!n)
+                return NFT_SUCCESS;
+
+        _rcu_write_lock(_prefs_rcu(p));
+        NftResult r = _class_register_table(p, table, n);
+        _rcu_write_unlock(_prefs_rcu(p));
+
+        return r;
+}
+
+
+/**
+ * pack all registered classes tightly and release memory that is left over
+ * after many classes were unregistered. Long-running processes that
+ * register & unregister lots of classes should call this every now and then.
+ *
+ * @param p NftPrefs context
+ * @result NFT_SUCCESS or NFT_FAILURE
+ * @note Classes move, so no other thread may use p meanwhile.
+ */
+NftResult nft_prefs_class_compact(NftPrefs * p)
+{
+        if(!p)
+                NFT_LOG_NULL(NFT_FAILURE);
+
+        _rcu_write_lock(_prefs_rcu(p));
+
+        NftResult r = NFT_FAILURE;
+        if(_prefs_is_frozen(p))
+                goto _pcc_exit;
+
+        /* unregistered classes must not be moved */
+        if(!_reclaim_all(p))
+                goto _pcc_exit;
+
+        /* classes cached by parsed nodes may move */
+        _prefs_registry_changed(p);
+
+        r = nft_array_compact(_prefs_classes(p), _class_remap, NULL);
+
+        /* old version points to old locations */
+        if(!_publish(p, NULL))
+                r = NFT_FAILURE;
+
+_pcc_exit:
+        _rcu_write_unlock(_prefs_rcu(p));
+        return r;
+}
+
+
+/**
+ * get the id of a registered class. Passing the id instead of the name to
+ * nft_prefs_obj_to_node_by_id() and nft_prefs_obj_from_node_by_id() saves
+ * looking up the class on every call.
+ *
+ * @param p NftPrefs context
+ * @param className name of class
+ * @result id of class or NFT_PREFS_CLASS_ID_INVALID upon error
+ * @note The id becomes invalid when the class is unregistered or moved by
+ *       nft_prefs_class_compact(). It never refers to another class.
+ */
+NftPrefsClassId nft_prefs_class_get_handle(NftPrefs * p, const char *className)
+{
+        if(!p || !className)
+                NFT_LOG_NULL(NFT_PREFS_CLASS_ID_INVALID);
+
+        unsigned int phase = _rcu_read_lock(_prefs_rcu(p));
+
+        /* class & id must come from the same version of the registry */
+        NftPrefsClassSnapshot *n = _prefs_class_snapshot(p);
+        NftPrefsClassId id = NFT_PREFS_CLASS_ID_INVALID;
+        NftPrefsClass *klass;
+        if(!(klass = _snapshot_find(n, className)) ||
+           klass->slot >= _RCU_DEREFERENCE(&n->slots))
+                NFT_LOG(L_ERROR, "Class \"%s\" not registered", className);
+        else
+                id = _RCU_DEREFERENCE(&n->ids[klass->slot]);
+
+        _rcu_read_unlock(_prefs_rcu(p), phase);
+
+        return id;
+}
+
+
+/**
+ * start or stop updating performance counters of all classes. Counters
+ * aren't reset, they're kept while statistics are disabled.
+ *
+ * @param p NftPrefs context
+ * @param enable true to count calls of NftPrefsToObjFunc,
+ *        NftPrefsFromObjFunc & NftPrefsUpdaterFunc of all classes
+ */
+void nft_prefs_class_stats_enable(NftPrefs * p, bool enable)
+{
+        if(!p)
+                NFT_LOG_NULL();
+
+        _prefs_set_stats_enabled(p, enable);
+}
+
+
+/**
+ * call a function with the performance counters of every registered class
+ *
+ * @param p NftPrefs context
+ * @param func function called for every class
+ * @param userptr arbitrary pointer passed to func
+ */
+void nft_prefs_class_stats_foreach(NftPrefs * p, NftPrefsClassStatsFunc * func,
+                                   void *userptr)
+{
+        if(!p || !func)
+                NFT_LOG_NULL();
+
+        unsigned int phase = _rcu_read_lock(_prefs_rcu(p));
+
+        NftPrefsClassSnapshot *n;
+        if((n = _prefs_class_snapshot(p)))
         {
-                NFT_LOG(L_ERROR, "Failed to init updater array");
-                goto _pcr_error;
-        }
+                size_t s, slots = _RCU_DEREFERENCE(&n->slots);
+                for(s = 0; s < slots; s++)
+                {
+                        NftPrefsClass *klass;
+                        if(!(klass = _RCU_DEREFERENCE(&n->bySlot[s])))
+                                continue;
 
-        /* register new class */
-        strncpy(n->name, className, NFT_PREFS_MAX_CLASSNAME);
-        n->toObj = toObj;
-        n->fromObj = fromObj;
-        n->slot = s;
+                        /* counters may change meanwhile */
+                        NftPrefsClassStats copy;
+                        _call_stats_get(&klass->stats.toObj, &copy.toObj);
+                        _call_stats_get(&klass->stats.fromObj, &copy.fromObj);
+                        _call_stats_get(&klass->stats.updater, &copy.updater);
+                        copy.nodes = _counter_get(&klass->stats.nodes);
 
-        return NFT_SUCCESS;
+                        func(klass->name, &copy, userptr);
+                }
+        }
 
-_pcr_error:
-        nft_array_slot_free(_prefs_classes(p), s);
-        return NFT_FAILURE;
+        _rcu_read_unlock(_prefs_rcu(p), phase);
 }
 
 
 /**
- * unregister class from current context
+ * unregister class from current context. Other threads may still use the
+ * class until they're done with it, its memory is freed afterwards.
  *
  * @param p NftPrefs context
  * @param className name of class
+ * @note This rebuilds the lookup tables of the registry (O(classes)) and
+ *       waits until no other thread uses the old ones anymore.
  */
 void nft_prefs_class_unregister(NftPrefs * p, const char *className)
 {
         if(!p || !className)
                 NFT_LOG_NULL();
 
+        _rcu_write_lock(_prefs_rcu(p));
 
+        if(_prefs_is_frozen(p))
+                goto _pcu_exit;
 
         /* find class */
         NftPrefsClass *klass;
-        if(!(klass = _class_find_by_name(_prefs_classes(p), className)))
+        if(!(klass = _class_find_by_name(p, className)))
         {
                 NFT_LOG(L_ERROR,
                         "tried to unregister class \"%s\" that is not registered.",
                         className);
-                return;
+                goto _pcu_exit;
         }
 
+        /* parsed nodes may still cache this class */
+        _prefs_registry_changed(p);
 
-        /* free class */
-        _class_free(p, klass);
+        /* remove class from registry (it's freed when no reader uses it) */
+        klass->unregistered = true;
+        if(!_publish(p, klass))
+        {
+                NFT_LOG(L_ERROR, "failed to unregister class \"%s\"",
+                        className);
+                klass->unregistered = false;
+        }
 
+_pcu_exit:
+        _rcu_write_unlock(_prefs_rcu(p));
 }
 
 /**
@@ -48,11 +48,53 @@
 #include "niftyprefs-class.h"
 
 
-NftResult                       _class_init_array(NftArray * a);
+/** frozen class registry (s. nft_prefs_freeze()) */
+typedef struct _NftPrefsClassTable NftPrefsClassTable;
+
+/** one immutable version of the class registry */
+typedef struct _NftPrefsClassSnapshot NftPrefsClassSnapshot;
+
+/** updaters of one class to run between two versions (s. _updater_node_process()) */
+typedef struct _NftPrefsUpdatePlan NftPrefsUpdatePlan;
+/** version of the updaters of a class (s. updater.c) */
+typedef struct _NftPrefsUpdaterList NftPrefsUpdaterList;
+
+/** set of classes by slot (s. _class_in_set()) */
+typedef struct
+{
+        /** bit (s % 64) of word (s / 64) is set if the class in slot s is a member */
+        uint64_t *bits;
+        /** amount of slots described by bits */
+        size_t slots;
+} NftPrefsClassSet;
+
+
+NftResult                       _class_init_array(NftArray * a, const NftAllocator * allocator);
 void                            _class_free(NftPrefs * p, NftPrefsClass * klass);
-NftPrefsClass                  *_class_find_by_name(NftPrefsClasses * c, const char *name);
+NftPrefsClass                  *_class_find_by_name(NftPrefs * p, const char *name);
+NftPrefsClass                  *_class_find_by_id(NftPrefs * p, NftPrefsClassId id);
+const char                     *_class_name(NftPrefsClass * c);
 NftPrefsFromObjFunc            *_class_fromObj(NftPrefsClass * c);
 NftPrefsToObjFunc              *_class_toObj(NftPrefsClass * c);
 NftPrefsUpdaters *              _class_updaters(NftPrefsClass * c);
+NftPrefsUpdaterList           **_class_updater_list(NftPrefsClass * c);
+bool                            _class_threadsafe(NftPrefsClass * c);
+void                            _class_set_threadsafe(NftPrefsClass * c, bool threadsafe);
+NftResult                       _class_freeze(NftPrefs * p);
+void                            _class_table_free(NftPrefs * p);
+void                            _class_registry_free(NftPrefs * p);
+bool                            _class_resolve_tree(NftPrefs * p, NftPrefsNode * node, const NftPrefsClassSet * migrate);
+bool                            _class_resolve_children(NftPrefs * p, NftPrefsNode * node, const NftPrefsClassSet * migrate);
+bool                            _class_node_migrates(NftPrefsNode * n);
+bool                            _class_in_set(const NftPrefsClassSet * set, NftPrefsClass * c);
+size_t                          _class_slots(NftPrefs * p);
+NftPrefsClass                  *_class_at(NftPrefs * p, NftArraySlot s);
+void                            _class_forget_tree(NftPrefsNode * node);
+NftPrefsClass                  *_class_cached(NftPrefs * p, NftPrefsNode * n);
+NftPrefsClass                  *_class_of_node(NftPrefs * p, NftPrefsNode * n);
+NftPrefsClassStats             *_class_stats(NftPrefsClass * c);
+uint64_t                        _class_stats_start(NftPrefs * p);
+void                            _class_stats_end(NftPrefsCallStats * s, uint64_t start, NftResult r);
+void                            _class_stats_nodes(NftPrefsClass * c, NftPrefsNode * node);
 
 #endif /** _CLASS_H */
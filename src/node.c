@@ -53,6 +53,8 @@
  */
 
 #include <malloc.h>
+#include <limits.h>
+#include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -64,10 +66,171 @@
 
 
 
+/** name of processing instruction that identifies a sidecar cache */
+#define CACHE_PI          "niftyprefs-cache"
+/** suffix of sidecar cache files */
+#define CACHE_SUFFIX      ".cache"
+
+
+
 /******************************************************************************/
 /**************************** STATIC FUNCTIONS ********************************/
 /******************************************************************************/
 
+/** libxml2 parser options for documents of a context */
+static int _parse_options(NftPrefs * p)
+{
+        /* updater threads can't share one dictionary of names */
+        return _prefs_update_threads(p) > 1 ? XML_PARSE_NODICT : 0;
+}
+
+
+/** build key of a source file for its sidecar cache: the cache is only valid
+    for the same file in the same state & the same context version */
+static NftResult _cache_key(NftPrefs * p, const char *filename, char *key,
+                            size_t size)
+{
+        struct stat sts;
+        if(stat(filename, &sts) == -1)
+                return NFT_FAILURE;
+
+        snprintf(key, size, "dev=%llu ino=%llu mtime=%lld.%09ld size=%lld "
+                 "version=%u", (unsigned long long) sts.st_dev,
+                 (unsigned long long) sts.st_ino,
+                 (long long) sts.st_mtim.tv_sec, (long) sts.st_mtim.tv_nsec,
+                 (long long) sts.st_size, _prefs_get_version(p));
+
+        return NFT_SUCCESS;
+}
+
+
+/** parse sidecar cache of filename if its key matches (NULL otherwise) */
+static xmlDoc *_cache_read(NftPrefs * p, const char *filename,
+                           const char *cachename, const char *key)
+{
+        if(access(cachename, R_OK) == -1)
+                return NULL;
+
+        xmlDoc *doc;
+        if(!(doc = xmlReadFile(cachename, NULL, _parse_options(p))))
+                return NULL;
+
+        /* key is the first child of the document */
+        xmlNode *pi = doc->children;
+        if(!pi || pi->type != XML_PI_NODE ||
+           strcmp((const char *) pi->name, CACHE_PI) != 0 ||
+           !pi->content || strcmp((const char *) pi->content, key) != 0)
+        {
+                NFT_LOG(L_DEBUG, "cache \"%s\" is outdated", cachename);
+                xmlFreeDoc(doc);
+                return NULL;
+        }
+
+        xmlUnlinkNode(pi);
+        xmlFreeNode(pi);
+
+        /* pretend to be the source file (s. nft_prefs_node_get_uri()) */
+        xmlFree((xmlChar *) doc->URL);
+        doc->URL = xmlStrdup(BAD_CAST filename);
+
+        NFT_LOG(L_DEBUG, "using cache \"%s\"", cachename);
+        return doc;
+}
+
+
+/** replace file atomically by document (with key of a sidecar cache as first
+    child if key is not NULL) */
+static NftResult _write_atomic(xmlDoc * doc, const char *filename,
+                               const char *key)
+{
+        /* replace the file a symlink points to, not the symlink */
+        char target[PATH_MAX];
+        if(!realpath(filename, target))
+        {
+                if(errno != ENOENT)
+                {
+                        NFT_LOG(L_ERROR, "Failed to resolve \"%s\" - %s",
+                                filename, strerror(errno));
+                        return NFT_FAILURE;
+                }
+
+                /* new file */
+                if(snprintf(target, sizeof(target), "%s", filename) >=
+                   (int) sizeof(target))
+                {
+                        NFT_LOG(L_ERROR, "filename \"%s\" too long", filename);
+                        return NFT_FAILURE;
+                }
+        }
+
+        char tmp[PATH_MAX];
+        if(snprintf(tmp, sizeof(tmp), "%s.XXXXXX", target) >=
+           (int) sizeof(tmp))
+        {
+                NFT_LOG(L_ERROR, "filename \"%s\" too long", target);
+                return NFT_FAILURE;
+        }
+
+        int fd;
+        if((fd = mkstemp(tmp)) == -1)
+        {
+                NFT_LOG(L_ERROR, "Failed to create \"%s\" - %s",
+                        tmp, strerror(errno));
+                return NFT_FAILURE;
+        }
+
+        /* keep permissions (& owner, if we may) of file we replace */
+        struct stat sts;
+        if(stat(target, &sts) == 0)
+        {
+                if(fchown(fd, sts.st_uid, sts.st_gid) == -1)
+                        NFT_LOG(L_DEBUG, "Failed to keep owner of \"%s\" - %s",
+                                target, strerror(errno));
+
+                if(fchmod(fd, sts.st_mode & 07777) == -1)
+                {
+                        NFT_LOG(L_ERROR, "Failed to keep mode of \"%s\" - %s",
+                                target, strerror(errno));
+                        close(fd);
+                        unlink(tmp);
+                        return NFT_FAILURE;
+                }
+        }
+        close(fd);
+
+        xmlNode *pi = NULL;
+        if(key && (!(pi = xmlNewDocPI(doc, BAD_CAST CACHE_PI, BAD_CAST key)) ||
+                   !xmlAddPrevSibling(xmlDocGetRootElement(doc), pi)))
+        {
+                NFT_LOG(L_ERROR, "Failed to add key to cache");
+                xmlFreeNode(pi);
+                unlink(tmp);
+                return NFT_FAILURE;
+        }
+
+        NftResult r = NFT_FAILURE;
+        if(xmlSaveFormatFileEnc(tmp, doc, "UTF-8", 1) < 0)
+                NFT_LOG(L_ERROR, "Failed to save XML file \"%s\"", tmp);
+        else if(rename(tmp, target) == -1)
+                NFT_LOG(L_ERROR, "Failed to replace \"%s\" - %s",
+                        target, strerror(errno));
+        else
+                r = NFT_SUCCESS;
+
+        if(!r)
+                unlink(tmp);
+
+        if(pi)
+        {
+                xmlUnlinkNode(pi);
+                xmlFreeNode(pi);
+        }
+
+        return r;
+}
+
+
+
 /******************************************************************************/
 /**************************** PRIVATE FUNCTIONS *******************************/
 /******************************************************************************/
@@ -87,9 +250,13 @@
  */
 NftResult nft_prefs_node_add_child(NftPrefsNode * parent, NftPrefsNode * cur)
 {
-		if(!parent)
+		if(!parent || !cur)
 				NFT_LOG_NULL(NFT_FAILURE);
 
+        /* classes cached for another document are meaningless here */
+        if(cur->doc != parent->doc && cur->type == XML_ELEMENT_NODE)
+                _class_forget_tree(cur);
+
         return xmlAddChild(parent, cur) ? NFT_SUCCESS : NFT_FAILURE;
 }
 
@@ -546,13 +713,30 @@ _pntf_exit:
  */
 NftPrefsNode *nft_prefs_node_from_file(NftPrefs *p, const char *filename)
 {
-        if(!filename)
+        if(!p || !filename)
                 NFT_LOG_NULL(NULL);
 
 
+        /* stdin can't be written back */
+        NftPrefsWriteback writeback = _prefs_writeback(p);
+        if(strcmp("-", filename) == 0)
+                writeback = NFT_PREFS_WRITEBACK_NONE;
+
+        /* updated version of this file cached? */
+        char key[256], cachename[PATH_MAX];
+        xmlDocPtr doc = NULL;
+        if(writeback == NFT_PREFS_WRITEBACK_SIDECAR)
+        {
+                if(snprintf(cachename, sizeof(cachename), "%s" CACHE_SUFFIX,
+                            filename) >= (int) sizeof(cachename) ||
+                   !_cache_key(p, filename, key, sizeof(key)))
+                        writeback = NFT_PREFS_WRITEBACK_NONE;
+                else
+                        doc = _cache_read(p, filename, cachename, key);
+        }
+
         /* parse XML */
-        xmlDocPtr doc;
-        if(!(doc = xmlReadFile(filename, NULL, 0)))
+        if(!doc && !(doc = xmlReadFile(filename, NULL, _parse_options(p))))
         {
                 NFT_LOG(L_ERROR, "Failed to xmlReadFile(\"%s\")", filename);
                 return NULL;
@@ -576,14 +760,36 @@ NftPrefsNode *nft_prefs_node_from_file(NftPrefs *p, const char *filename)
                 goto _npnff_error;
         }
 
-		/* update node */
-		if(!_updater_node_process(p, node))
+		/* cache classes of all nodes & update node (classes stay valid
+		   meanwhile) */
+		bool migrated;
+		unsigned int phase = _rcu_read_lock(_prefs_rcu(p));
+		NftResult updated = _updater_node_process(p, node, &migrated);
+		_rcu_read_unlock(_prefs_rcu(p), phase);
+
+		if(!updated)
 		{
 				NFT_LOG(L_ERROR, "Preference update failed for node \"%s\". This is a fatal bug. Aborting.",
 				        nft_prefs_node_get_name(node));
 				goto _npnff_error;
 		}
 
+		/* save updated preferences, so they only get updated once (included
+		   files would end up inside the written file) */
+		if(migrated && writeback != NFT_PREFS_WRITEBACK_NONE)
+		{
+				if(xinc_res > 0)
+						NFT_LOG(L_INFO, "\"%s\" includes other files, "
+						        "not writing back updated preferences",
+						        filename);
+				else if(!(writeback == NFT_PREFS_WRITEBACK_INPLACE ?
+				          _write_atomic(doc, filename, NULL) :
+				          _write_atomic(doc, cachename, key)))
+						NFT_LOG(L_WARNING, "Failed to write back updated "
+						        "preferences of \"%s\", they will be "
+						        "updated again next time", filename);
+		}
+
 		/* return node */
         return node;
 
@@ -594,6 +800,38 @@ _npnff_error:
 }
 
 
+/**
+ * choose what nft_prefs_node_from_file() does with preferences it had to
+ * update, so updaters only run once per file instead of on every start.
+ * Files are written to a temporary file that is then renamed, so readers
+ * never see half of a file. Files that use XInclude are never written back.
+ *
+ * @param p NftPrefs context
+ * @param mode NftPrefsWriteback mode
+ * @result NFT_SUCCESS or NFT_FAILURE
+ * @note NFT_PREFS_WRITEBACK_SIDECAR caches are only used while the source
+ *       file (device, inode, size & modification time) and the version of
+ *       the context are unchanged
+ */
+NftResult nft_prefs_node_set_writeback(NftPrefs *p, NftPrefsWriteback mode)
+{
+        if(!p)
+                NFT_LOG_NULL(NFT_FAILURE);
+
+        if(mode != NFT_PREFS_WRITEBACK_NONE &&
+           mode != NFT_PREFS_WRITEBACK_INPLACE &&
+           mode != NFT_PREFS_WRITEBACK_SIDECAR)
+        {
+                NFT_LOG(L_ERROR, "invalid writeback mode %d", mode);
+                return NFT_FAILURE;
+        }
+
+        _prefs_set_writeback(p, mode);
+
+        return NFT_SUCCESS;
+}
+
+
 /**
  * create new NftPrefsNode from preferences buffer
  *
@@ -610,7 +848,8 @@ NftPrefsNode *nft_prefs_node_from_buffer(NftPrefs *p, char *buffer, size_t bufsi
 
         /* parse XML */
         xmlDocPtr doc;
-        if(!(doc = xmlReadMemory(buffer, bufsize, NULL, NULL, 0)))
+        if(!(doc = xmlReadMemory(buffer, bufsize, NULL, NULL,
+                                 _parse_options(p))))
         {
                 NFT_LOG(L_ERROR, "Failed to xmlReadMemory()");
                 return NULL;
@@ -633,8 +872,13 @@ NftPrefsNode *nft_prefs_node_from_buffer(NftPrefs *p, char *buffer, size_t bufsi
                 goto _npnfb_error;
         }
 
-        /* update node */
-        if(!_updater_node_process(p, node))
+        /* cache classes of all nodes & update node (classes stay valid
+           meanwhile) */
+        unsigned int phase = _rcu_read_lock(_prefs_rcu(p));
+        NftResult updated = _updater_node_process(p, node, NULL);
+        _rcu_read_unlock(_prefs_rcu(p), phase);
+
+        if(!updated)
         {
                 NFT_LOG(L_ERROR, "Preference update failed for node \"%s\". This is a fatal bug. Aborting.",
                         nft_prefs_node_get_name(node));
@@ -67,6 +67,58 @@
 /**************************** STATIC FUNCTIONS ********************************/
 /******************************************************************************/
 
+/** create node from object using class c */
+static NftPrefsNode *_obj_to_node(NftPrefs * p, NftPrefsClass * c, void *obj,
+                                  void *userptr)
+{
+        /* find object descriptor */
+        /* NftPrefsObjSlot os; if((os = _obj_find_by_ptr(c, obj)) < 0) return
+         * NULL; NftPrefsObj *o = _obj_get(c, os); */
+
+        /* new node */
+        NftPrefsNode *node;
+        if(!(node = nft_prefs_node_alloc(_class_name(c))))
+                return NULL;
+
+
+        /* call prefsFromObj() registered for this class */
+        uint64_t start = _class_stats_start(p);
+        NftResult r = _class_fromObj(c) (p, node, obj, userptr);
+        _class_stats_end(&_class_stats(c)->fromObj, start, r);
+        if(!r)
+        {
+                NFT_LOG(L_ERROR, "prefsFromObj() of class \"%s\" failed.",
+                        _class_name(c));
+                return NULL;
+        }
+
+        if(start)
+                _class_stats_nodes(c, node);
+
+        return node;
+}
+
+
+/** create object from node using class c */
+static void *_obj_from_node(NftPrefs * p, NftPrefsClass * c, NftPrefsNode * n,
+                            void *userptr)
+{
+        /* create object from prefs */
+        void *result = NULL;
+        uint64_t start = _class_stats_start(p);
+        NftResult r = _class_toObj(c) (p, &result, n, userptr);
+        _class_stats_end(&_class_stats(c)->toObj, start, r);
+        if(!r)
+        {
+                NFT_LOG(L_ERROR,
+                        "prefsToObj() of class \"%s\" function failed",
+                        n->name);
+                return NULL;
+        }
+
+        return result;
+}
+
 
 /******************************************************************************/
 /**************************** PRIVATE FUNCTIONS *******************************/
@@ -93,32 +145,53 @@ NftPrefsNode *nft_prefs_obj_to_node(NftPrefs * p, const char *className,
         if(!p || !className)
                 NFT_LOG_NULL(NULL);
 
+        /* class can't be freed until we're done */
+        unsigned int phase = _rcu_read_lock(_prefs_rcu(p));
+
         /* find class */
+        NftPrefsNode *node = NULL;
         NftPrefsClass *c;
-        if(!(c = _class_find_by_name(_prefs_classes(p), className)))
-        {
+        if(!(c = _class_find_by_name(p, className)))
                 NFT_LOG(L_ERROR, "Unknown prefs class \"%s\"", className);
-                return NULL;
-        }
+        else
+                node = _obj_to_node(p, c, obj, userptr);
 
+        _rcu_read_unlock(_prefs_rcu(p), phase);
 
-        /* find object descriptor */
-        /* NftPrefsObjSlot os; if((os = _obj_find_by_ptr(c, obj)) < 0) return
-         * NULL; NftPrefsObj *o = _obj_get(c, os); */
+        return node;
+}
 
-        /* new node */
-        NftPrefsNode *node;
-        if(!(node = nft_prefs_node_alloc(className)))
-                return NULL;
 
+/**
+ * create a NftPrefsNode from a previously registered object of a class
+ * given by its id. Use this instead of nft_prefs_obj_to_node() when lots
+ * of objects of the same class are processed.
+ *
+ * @param p NftPrefs context
+ * @param id id of class from nft_prefs_class_get_handle()
+ * @param obj pointer to object
+ * @param userptr arbitrary pointer that will be passed to NftPrefsFromObjFunc
+ * @result newly created NftPrefsNode or NULL
+ */
+NftPrefsNode *nft_prefs_obj_to_node_by_id(NftPrefs * p, NftPrefsClassId id,
+                                          void *obj, void *userptr)
+{
+        if(!p)
+                NFT_LOG_NULL(NULL);
 
-        /* call prefsFromObj() registered for this class */
-        if(!_class_fromObj(c) (p, node, obj, userptr))
-        {
-                NFT_LOG(L_ERROR, "prefsFromObj() of class \"%s\" failed.",
-                        className);
-                return NULL;
-        }
+        /* class can't be freed until we're done */
+        unsigned int phase = _rcu_read_lock(_prefs_rcu(p));
+
+        /* get class */
+        NftPrefsNode *node = NULL;
+        NftPrefsClass *c;
+        if(!(c = _class_find_by_id(p, id)))
+                NFT_LOG(L_ERROR, "Invalid prefs class id 0x%llx",
+                        (unsigned long long) id);
+        else
+                node = _obj_to_node(p, c, obj, userptr);
+
+        _rcu_read_unlock(_prefs_rcu(p), phase);
 
         return node;
 }
@@ -138,29 +211,68 @@ void *nft_prefs_obj_from_node(NftPrefs * p, NftPrefsNode * n, void *userptr)
         if(!p || !n)
                 NFT_LOG_NULL(NULL);
 
+        /* class can't be freed until we're done */
+        unsigned int phase = _rcu_read_lock(_prefs_rcu(p));
+
         /* find object class */
+        void *obj = NULL;
         NftPrefsClass *c;
-        if(!
-           (c =
-            _class_find_by_name(_prefs_classes(p),
-                                     (const char *) n->name)))
-        {
+        if(!(c = _class_of_node(p, n)))
                 NFT_LOG(L_ERROR, "Unknown prefs class \"%s\"", n->name);
-                return NULL;
-        }
+        else
+                obj = _obj_from_node(p, c, n, userptr);
 
+        _rcu_read_unlock(_prefs_rcu(p), phase);
 
-        /* create object from prefs */
-        void *result = NULL;
-        if(!(_class_toObj(c) (p, &result, n, userptr)))
+        return obj;
+}
+
+
+/**
+ * create object from a NftPrefsNode whose class is known in advance. Use
+ * this instead of nft_prefs_obj_from_node() when lots of nodes of the same
+ * class are processed.
+ *
+ * @param p NftPrefs context
+ * @param id id of class from nft_prefs_class_get_handle()
+ * @param n NftPrefsNode (must be a node of class id)
+ * @param userptr arbitrary function that will be passed to NftPrefsToObjFunc
+ * @result newly created object or NULL
+ */
+void *nft_prefs_obj_from_node_by_id(NftPrefs * p, NftPrefsClassId id,
+                                    NftPrefsNode * n, void *userptr)
+{
+        if(!p || !n)
+                NFT_LOG_NULL(NULL);
+
+        /* class can't be freed until we're done */
+        unsigned int phase = _rcu_read_lock(_prefs_rcu(p));
+
+        /* get class */
+        void *obj = NULL;
+        NftPrefsClass *c;
+        if(!(c = _class_find_by_id(p, id)))
+        {
+                NFT_LOG(L_ERROR, "Invalid prefs class id 0x%llx",
+                        (unsigned long long) id);
+        }
+        /* node must belong to this class (the class cached while parsing
+           spares the name compare, renamed nodes still get compared) */
+        else if(_class_cached(p, n) != c &&
+                strcmp(_class_name(c), (const char *) n->name) != 0)
         {
                 NFT_LOG(L_ERROR,
-                        "prefsToObj() of class \"%s\" function failed",
-                        n->name);
-                return NULL;
+                        "node \"%s\" is not of prefs class \"%s\"",
+                        n->name, _class_name(c));
+        }
+        else
+        {
+                obj = _obj_from_node(p, c, n, userptr);
         }
 
-        return result;
+        _rcu_read_unlock(_prefs_rcu(p), phase);
+
+        return obj;
 }
 
 
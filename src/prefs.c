@@ -56,24 +56,72 @@
 #include <niftylog.h>
 #include "niftyprefs.h"
 #include "class.h"
+#include "prefs.h"
+#include "allocator.h"
+#include "rcu.h"
 #include "config.h"
 
 
 
 
-/** context descriptor */
-struct _NftPrefs
+/** classes & updaters - owned by one or shared by many contexts */
+struct _NftPrefsRegistry
 {
+        /** contexts using this registry + references taken by
+            nft_prefs_registry_ref() */
+        unsigned long refs;
         /** list of registered PrefsObjClasses */
         NftPrefsClasses classes;
+        /** copy of the allocator passed to nft_prefs_init_with_allocator() */
+        NftAllocator allocatorCopy;
+        /** allocator of this registry and all contexts using it
+            (&allocatorCopy or NULL for malloc()/free()) */
+        const NftAllocator *allocator;
+        /** current version of the class registry (s. _class_init_array()) */
+        NftPrefsClassSnapshot *classSnapshot;
+        /** readers & writers of classSnapshot & classTable */
+        NftRcu rcu;
+        /** frozen class registry or NULL (s. nft_prefs_freeze()) */
+        NftPrefsClassTable *classTable;
+        /** unique id of the current state of the class registry. Documents
+            parsed by a context carry it while their nodes cache their
+            classes (s. _class_resolve_tree()) */
+        uintptr_t epoch;
+};
+
+
+/** context descriptor */
+struct _NftPrefs
+{
+        /** classes & updaters of this context */
+        NftPrefsRegistry *registry;
         /** version of this context. This is an unsigned integer to
             differ between preference versions.
             - older versions should always be < than newer versions.
             - versions should increase in steps of 1 */
         unsigned int version;
+        /** true if performance counters of classes are updated */
+        bool stats;
+        /** amount of threads that update a document (s.
+            nft_prefs_updater_set_threads()) */
+        unsigned int updateThreads;
+        /** what to do with files that were updated while parsing (s.
+            nft_prefs_node_set_writeback()) */
+        NftPrefsWriteback writeback;
 };
 
 
+/** registry epochs handed out so far (by all contexts) */
+static uintptr_t _epochs;
+
+
+/** allocator used for libxml2 (s. nft_prefs_set_xml_allocator()) */
+static NftAllocator _xml_allocator;
+
+/** registries alive (libxml2 is cleaned up when the last one is freed) */
+static unsigned long _registries;
+
+
 
 
 
@@ -81,6 +129,41 @@ struct _NftPrefs
 /**************************** STATIC FUNCTIONS ********************************/
 /******************************************************************************/
 
+/** libxml2 malloc() replacement */
+static void *_xml_malloc(size_t size)
+{
+        return _xml_allocator.alloc(size, _xml_allocator.userptr);
+}
+
+
+/** libxml2 realloc() replacement */
+static void *_xml_realloc(void *ptr, size_t size)
+{
+        return _xml_allocator.realloc(ptr, size, _xml_allocator.userptr);
+}
+
+
+/** libxml2 free() replacement */
+static void _xml_free(void *ptr)
+{
+        if(ptr)
+                _xml_allocator.free(ptr, _xml_allocator.userptr);
+}
+
+
+/** libxml2 strdup() replacement */
+static char *_xml_strdup(const char *s)
+{
+        size_t length = strlen(s) + 1;
+
+        char *r;
+        if(!(r = _xml_allocator.alloc(length, _xml_allocator.userptr)))
+                return NULL;
+
+        return memcpy(r, s, length);
+}
+
+
 /** libxml error handler */
 static void _xml_error_handler(void *ctx, const char *msg, ...)
 {
@@ -130,49 +213,106 @@ static void _xml_error_handler(void *ctx, const char *msg, ...)
 }
 
 
-/** helper for nft_array_foreach_element() */
-static bool _class_free_helper(void *element, void *userptr)
+/** take reference to registry */
+static void _registry_ref(NftPrefsRegistry * r)
 {
-        NftPrefs *p = userptr;
-
-        _class_free(p, (NftPrefsClass *) element);
-        return true;
+#ifdef HAVE_BUILTIN_ATOMIC
+        __atomic_add_fetch(&r->refs, 1, __ATOMIC_RELAXED);
+#else
+        r->refs++;
+#endif
 }
 
 
+/** free registry with all its classes */
+static void _registry_free(NftPrefsRegistry * r)
+{
+        /* class functions only touch the registry of a context */
+        NftPrefs tmp = {.registry = r };
 
-/******************************************************************************/
-/**************************** PRIVATE FUNCTIONS *******************************/
-/******************************************************************************/
+        /* free all versions of the registry & classes that were unregistered */
+        _class_registry_free(&tmp);
 
-/** getter */
-NftPrefsClasses *_prefs_classes(NftPrefs * p)
-{
-        return &p->classes;
+        /* free frozen registry */
+        _class_table_free(&tmp);
+
+        /* free all classes */
+        NftArraySlot s;
+        NftPrefsClass *c;
+        NFT_ARRAY_FOREACH(&r->classes, s, c)
+        {
+                _class_free(&tmp, c);
+        }
+
+        /* free classes array */
+        nft_array_deinit(&r->classes);
+
+        /* free descriptor (r->allocator lives inside r) */
+        NftAllocator allocator = r->allocatorCopy;
+        _mem_free(r->allocator ? &allocator : NULL, r);
+
+        /* cleanup XML parser when no context or reference is left */
+#ifdef HAVE_BUILTIN_ATOMIC
+        if(__atomic_sub_fetch(&_registries, 1, __ATOMIC_ACQ_REL) == 0)
+#else
+        if(--_registries == 0)
+#endif
+                xmlCleanupParser();
 }
 
 
-/** getter */
-unsigned int _prefs_get_version(NftPrefs * p)
+/** drop reference to registry & free it when it was the last one */
+static void _registry_unref(NftPrefsRegistry * r)
 {
-        return p->version;
+#ifdef HAVE_BUILTIN_ATOMIC
+        if(__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0)
+#else
+        if(--r->refs == 0)
+#endif
+                _registry_free(r);
 }
 
 
+/** create empty registry */
+static NftPrefsRegistry *_registry_new(const NftAllocator * allocator)
+{
+        NftPrefsRegistry *r;
+        if(!(r = _mem_calloc(allocator, 1, sizeof(NftPrefsRegistry))))
+        {
+                NFT_LOG_PERROR("calloc");
+                return NULL;
+        }
 
-/******************************************************************************/
-/**************************** API FUNCTIONS ***********************************/
-/******************************************************************************/
+        r->refs = 1;
 
+        /* save allocator */
+        if(allocator)
+        {
+                r->allocatorCopy = *allocator;
+                r->allocator = &r->allocatorCopy;
+        }
+
+        /* allocate array to store classes that will be registered */
+        if(!_class_init_array(&r->classes, r->allocator))
+        {
+                NFT_LOG(L_ERROR, "Failed to init class array");
+                _mem_free(allocator, r);
+                return NULL;
+        }
+
+#ifdef HAVE_BUILTIN_ATOMIC
+        __atomic_add_fetch(&_registries, 1, __ATOMIC_RELAXED);
+#else
+        _registries++;
+#endif
+
+        return r;
+}
 
-/**
- * initialize libniftyprefs - call this once before doing any other API call
- *
- * @result new NftPrefs descriptor or NULL upon failure
- */
-NftPrefs *nft_prefs_init(unsigned int version)
-{
 
+/** setup libxml2 & create context using registry (takes over reference) */
+static NftPrefs *_prefs_new(unsigned int version, NftPrefsRegistry * r)
+{
         /* 
          * this initializes the library and check potential ABI mismatches
          * between the version it was compiled for and the actual shared
@@ -191,7 +331,7 @@ NftPrefs *nft_prefs_init(unsigned int version)
 
         /* allocate new NftPrefs context */
         NftPrefs *p;
-        if(!(p = calloc(1, sizeof(NftPrefs))))
+        if(!(p = _mem_calloc(r->allocator, 1, sizeof(NftPrefs))))
         {
                 NFT_LOG_PERROR("calloc");
                 return NULL;
@@ -199,15 +339,207 @@ NftPrefs *nft_prefs_init(unsigned int version)
 
         /* save version */
         p->version = version;
+        p->registry = r;
 
-        /* allocate array to store classes that will be registered */
-        if(!_class_init_array(&p->classes))
+        return p;
+}
+
+
+
+/******************************************************************************/
+/**************************** PRIVATE FUNCTIONS *******************************/
+/******************************************************************************/
+
+/** getter */
+NftPrefsClasses *_prefs_classes(NftPrefs * p)
+{
+        return &p->registry->classes;
+}
+
+
+/** getter */
+unsigned int _prefs_get_version(NftPrefs * p)
+{
+        return p->version;
+}
+
+
+/** getter */
+const NftAllocator *_prefs_allocator(NftPrefs * p)
+{
+        return p->registry->allocator;
+}
+
+
+/** getter */
+NftRcu *_prefs_rcu(NftPrefs * p)
+{
+        return &p->registry->rcu;
+}
+
+
+/** getter (call inside read-side critical section or with write lock) */
+NftPrefsClassSnapshot *_prefs_class_snapshot(NftPrefs * p)
+{
+        return _RCU_DEREFERENCE(&p->registry->classSnapshot);
+}
+
+
+/** setter (call with write lock held) */
+void _prefs_set_class_snapshot(NftPrefs * p, NftPrefsClassSnapshot * s)
+{
+        _RCU_ASSIGN(&p->registry->classSnapshot, s);
+}
+
+
+/** getter (call inside read-side critical section or with write lock) */
+NftPrefsClassTable *_prefs_class_table(NftPrefs * p)
+{
+        return _RCU_DEREFERENCE(&p->registry->classTable);
+}
+
+
+/** setter (call with write lock held) */
+void _prefs_set_class_table(NftPrefs * p, NftPrefsClassTable * t)
+{
+        _RCU_ASSIGN(&p->registry->classTable, t);
+}
+
+
+/** getter */
+bool _prefs_stats_enabled(NftPrefs * p)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        return __atomic_load_n(&p->stats, __ATOMIC_RELAXED);
+#else
+        return p->stats;
+#endif
+}
+
+
+/** setter */
+void _prefs_set_stats_enabled(NftPrefs * p, bool enable)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        __atomic_store_n(&p->stats, enable, __ATOMIC_RELAXED);
+#else
+        p->stats = enable;
+#endif
+}
+
+
+/** getter */
+unsigned int _prefs_update_threads(NftPrefs * p)
+{
+        return p->updateThreads;
+}
+
+
+/** setter */
+void _prefs_set_update_threads(NftPrefs * p, unsigned int threads)
+{
+        p->updateThreads = threads;
+}
+
+
+/** getter */
+NftPrefsWriteback _prefs_writeback(NftPrefs * p)
+{
+        return p->writeback;
+}
+
+
+/** setter */
+void _prefs_set_writeback(NftPrefs * p, NftPrefsWriteback mode)
+{
+        p->writeback = mode;
+}
+
+
+/** getter */
+uintptr_t _prefs_epoch(NftPrefs * p)
+{
+        return _RCU_DEREFERENCE(&p->registry->epoch);
+}
+
+
+/** invalidate classes cached in nodes because classes were removed or moved */
+void _prefs_registry_changed(NftPrefs * p)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        _RCU_ASSIGN(&p->registry->epoch,
+                    __atomic_add_fetch(&_epochs, 1, __ATOMIC_RELAXED));
+#else
+        p->registry->epoch = ++_epochs;
+#endif
+}
+
+
+/** check if registry of context is frozen (and log error if it is) */
+bool _prefs_is_frozen(NftPrefs * p)
+{
+        if(!_prefs_class_table(p))
+                return false;
+
+        NFT_LOG(L_ERROR,
+                "classes & updaters can't be changed after nft_prefs_freeze()");
+        return true;
+}
+
+
+
+/******************************************************************************/
+/**************************** API FUNCTIONS ***********************************/
+/******************************************************************************/
+
+
+/**
+ * initialize libniftyprefs - call this once before doing any other API call
+ *
+ * @result new NftPrefs descriptor or NULL upon failure
+ */
+NftPrefs *nft_prefs_init(unsigned int version)
+{
+        return nft_prefs_init_with_allocator(version, NULL);
+}
+
+
+/**
+ * initialize libniftyprefs with a custom allocator. The context itself and
+ * all memory it uses to keep track of classes and updaters will be
+ * allocated using this allocator.
+ *
+ * @param version version of this context (s. nft_prefs_init())
+ * @param allocator NftAllocator to use or NULL for malloc()/realloc()/free().
+ *        The allocator is copied, but its userptr must stay valid until
+ *        nft_prefs_deinit()
+ * @result new NftPrefs descriptor or NULL upon failure
+ * @note use nft_prefs_set_xml_allocator() to also route libxml2 allocations
+ */
+NftPrefs *nft_prefs_init_with_allocator(unsigned int version,
+                                        const NftAllocator * allocator)
+{
+        if(allocator &&
+           (!allocator->alloc || !allocator->realloc || !allocator->free))
         {
-                NFT_LOG(L_ERROR, "Failed to init class array");
-                free(p);
+                NFT_LOG(L_ERROR, "incomplete allocator");
+                return NULL;
+        }
+
+        NftPrefsRegistry *r;
+        if(!(r = _registry_new(allocator)))
+                return NULL;
+
+        NftPrefs *p;
+        if(!(p = _prefs_new(version, r)))
+        {
+                _registry_unref(r);
                 return NULL;
         }
 
+        /* epoch of empty registry */
+        _prefs_registry_changed(p);
+
         return p;
 }
 
@@ -217,6 +549,9 @@ NftPrefs *nft_prefs_init(unsigned int version)
  * finally clean up
  *
  * @param p NftPrefs context
+ * @note xmlCleanupParser() is only called once the last context and the last
+ *       reference from nft_prefs_registry_ref() are gone, so other contexts
+ *       keep a working libxml2
  */
 void nft_prefs_deinit(NftPrefs * p)
 {
@@ -224,17 +559,105 @@ void nft_prefs_deinit(NftPrefs * p)
                 NFT_LOG_NULL();
 
 
-        /* free all classes */
-        nft_array_foreach_element(&p->classes, _class_free_helper, p);
+        /* free descriptor (allocator lives inside registry) */
+        NftPrefsRegistry *r = p->registry;
+        _mem_free(r->allocator, p);
 
-        /* free classes array */
-        nft_array_deinit(&p->classes);
+        /* free registry if no other context uses it */
+        _registry_unref(r);
+}
 
-        /* free descriptor */
-        free(p);
 
-        /* cleanup XML parser */
-        xmlCleanupParser();
+/**
+ * freeze the set of registered classes and updaters. Lookups then use a
+ * minimal perfect hash over all class names. They don't modify anything,
+ * so a frozen context can be used by any number of threads at once.
+ *
+ * @param p NftPrefs context
+ * @result NFT_SUCCESS or NFT_FAILURE
+ * @note registering or unregistering classes & updaters fails after this
+ */
+NftResult nft_prefs_freeze(NftPrefs * p)
+{
+        if(!p)
+                NFT_LOG_NULL(NFT_FAILURE);
+
+        _rcu_write_lock(_prefs_rcu(p));
+
+        NftResult r = _prefs_class_table(p) ? NFT_SUCCESS : _class_freeze(p);
+
+        _rcu_write_unlock(_prefs_rcu(p));
+
+        return r;
+}
+
+
+/**
+ * share the classes & updaters of a context with other contexts. The
+ * registry of p gets frozen (s. nft_prefs_freeze()) and can then be attached
+ * to any number of contexts using nft_prefs_init_shared(). It is freed
+ * when the last context using it was deinitialized and the last reference
+ * was dropped.
+ *
+ * @param p NftPrefs context with all classes & updaters registered
+ * @result new reference to the registry of p (drop it using
+ *         nft_prefs_registry_unref()) or NULL upon failure
+ */
+NftPrefsRegistry *nft_prefs_registry_ref(NftPrefs * p)
+{
+        if(!p)
+                NFT_LOG_NULL(NULL);
+
+        /* a shared registry must never change */
+        if(!nft_prefs_freeze(p))
+                return NULL;
+
+        _registry_ref(p->registry);
+
+        return p->registry;
+}
+
+
+/**
+ * drop a reference acquired by nft_prefs_registry_ref()
+ *
+ * @param r NftPrefsRegistry
+ */
+void nft_prefs_registry_unref(NftPrefsRegistry * r)
+{
+        if(!r)
+                NFT_LOG_NULL();
+
+        _registry_unref(r);
+}
+
+
+/**
+ * initialize libniftyprefs with the classes & updaters of another context.
+ * Nothing is registered or copied, so this is cheap. The new context uses
+ * the allocator of the registry.
+ *
+ * @param version version of this context (s. nft_prefs_init())
+ * @param r NftPrefsRegistry acquired by nft_prefs_registry_ref()
+ * @result new NftPrefs descriptor or NULL upon failure
+ * @note classes & updaters can't be registered or unregistered using the
+ *       new context
+ */
+NftPrefs *nft_prefs_init_shared(unsigned int version, NftPrefsRegistry * r)
+{
+        if(!r)
+                NFT_LOG_NULL(NULL);
+
+        _registry_ref(r);
+
+        NftPrefs *p;
+        if(!(p = _prefs_new(version, r)))
+        {
+                _registry_unref(r);
+                return NULL;
+        }
+
+        return p;
 }
 
 
@@ -250,6 +673,49 @@ void nft_prefs_free(void *p)
 }
 
 
+/**
+ * route all memory allocations of libxml2 through a custom allocator.
+ *
+ * @param allocator NftAllocator to use or NULL to restore
+ *        malloc()/realloc()/free()
+ * @result NFT_SUCCESS or NFT_FAILURE
+ * @note libxml2 allocators are process-wide, so this affects every NftPrefs
+ *       context and every other libxml2 user in this process. It must be
+ *       called before libxml2 allocated anything (i.e. before the first
+ *       nft_prefs_init()) and the allocator must stay valid until after
+ *       the last nft_prefs_deinit()
+ */
+NftResult nft_prefs_set_xml_allocator(const NftAllocator * allocator)
+{
+        if(!allocator)
+        {
+                if(xmlMemSetup(free, malloc, realloc, strdup) != 0)
+                {
+                        NFT_LOG(L_ERROR, "xmlMemSetup() failed");
+                        return NFT_FAILURE;
+                }
+
+                return NFT_SUCCESS;
+        }
+
+        if(!allocator->alloc || !allocator->realloc || !allocator->free)
+        {
+                NFT_LOG(L_ERROR, "incomplete allocator");
+                return NFT_FAILURE;
+        }
+
+        _xml_allocator = *allocator;
+
+        if(xmlMemSetup(_xml_free, _xml_malloc, _xml_realloc, _xml_strdup) != 0)
+        {
+                NFT_LOG(L_ERROR, "xmlMemSetup() failed");
+                return NFT_FAILURE;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
 
 
 /**
@@ -46,10 +46,27 @@
 
 
 #include "niftyprefs.h"
+#include "class.h"
+#include "rcu.h"
 
 
 NftPrefsClasses *               _prefs_classes(NftPrefs * p);
 unsigned int                    _prefs_get_version(NftPrefs * p);
+const NftAllocator             *_prefs_allocator(NftPrefs * p);
+NftRcu                         *_prefs_rcu(NftPrefs * p);
+NftPrefsClassSnapshot          *_prefs_class_snapshot(NftPrefs * p);
+void                            _prefs_set_class_snapshot(NftPrefs * p, NftPrefsClassSnapshot * s);
+NftPrefsClassTable             *_prefs_class_table(NftPrefs * p);
+void                            _prefs_set_class_table(NftPrefs * p, NftPrefsClassTable * t);
+bool                            _prefs_is_frozen(NftPrefs * p);
+uintptr_t                       _prefs_epoch(NftPrefs * p);
+bool                            _prefs_stats_enabled(NftPrefs * p);
+void                            _prefs_set_stats_enabled(NftPrefs * p, bool enable);
+unsigned int                    _prefs_update_threads(NftPrefs * p);
+void                            _prefs_set_update_threads(NftPrefs * p, unsigned int threads);
+NftPrefsWriteback               _prefs_writeback(NftPrefs * p);
+void                            _prefs_set_writeback(NftPrefs * p, NftPrefsWriteback mode);
+void                            _prefs_registry_changed(NftPrefs * p);
 
 
 #endif /** _PREFS_H */
@@ -0,0 +1,172 @@
+/*
+ * libniftyprefs - lightweight modelless preferences management library
+ * Copyright (C) 2006-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/**
+ * @file rcu.c
+ */
+
+/**
+ * @addtogroup prefs
+ * @{
+ *
+ */
+
+
+#include <sched.h>
+#include <niftylog.h>
+#include "rcu.h"
+#include "config.h"
+
+
+
+/** read-side critical sections the current thread is inside of (of any
+    NftRcu) */
+#ifdef HAVE_BUILTIN_ATOMIC
+static __thread unsigned int _nesting;
+#endif
+
+
+
+/******************************************************************************/
+/**************************** STATIC FUNCTIONS ********************************/
+/******************************************************************************/
+
+#ifdef HAVE_BUILTIN_ATOMIC
+/** let readers of a phase leave before starting a new one */
+static void _wait_for_readers(NftRcu * r, unsigned int phase)
+{
+        while(__atomic_load_n(&r->readers[phase], __ATOMIC_SEQ_CST))
+                sched_yield();
+}
+#endif /* HAVE_BUILTIN_ATOMIC */
+
+
+
+/******************************************************************************/
+/**************************** PRIVATE FUNCTIONS *******************************/
+/******************************************************************************/
+
+/**
+ * enter read-side critical section. Everything published with
+ * _RCU_ASSIGN() & read with _RCU_DEREFERENCE() stays valid until
+ * _rcu_read_unlock(). Read-side critical sections may be nested.
+ *
+ * @param r NftRcu state
+ * @result phase that must be passed to _rcu_read_unlock()
+ */
+unsigned int _rcu_read_lock(NftRcu * r)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        unsigned int phase = __atomic_load_n(&r->phase, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&r->readers[phase], 1, __ATOMIC_SEQ_CST);
+        _nesting++;
+        return phase;
+#else
+        return 0;
+#endif
+}
+
+
+/** leave read-side critical section */
+void _rcu_read_unlock(NftRcu * r, unsigned int phase)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        _nesting--;
+        __atomic_sub_fetch(&r->readers[phase], 1, __ATOMIC_RELEASE);
+#endif
+}
+
+
+/** serialize writers */
+void _rcu_write_lock(NftRcu * r)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        while(__atomic_exchange_n(&r->writer, true, __ATOMIC_ACQUIRE))
+                sched_yield();
+#endif
+}
+
+
+/** release write lock */
+void _rcu_write_unlock(NftRcu * r)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        __atomic_store_n(&r->writer, false, __ATOMIC_RELEASE);
+#endif
+}
+
+
+/**
+ * wait until all readers that could still see something that was replaced
+ * using _RCU_ASSIGN() left their read-side critical section. Must be called
+ * with the write lock held.
+ *
+ * @param r NftRcu state
+ * @result true if the old versions can be freed now or false if the
+ *         calling thread is a reader itself (waiting would never end). The
+ *         old versions must be freed by a later call then.
+ */
+bool _rcu_synchronize(NftRcu * r)
+{
+#ifdef HAVE_BUILTIN_ATOMIC
+        if(_nesting)
+                return false;
+
+        /* readers may have picked the current phase before the last flip
+           & entered it after the last wait, so wait for both phases */
+        int i;
+        for(i = 0; i < 2; i++)
+        {
+                unsigned int phase = r->phase;
+                __atomic_store_n(&r->phase, phase ^ 1, __ATOMIC_SEQ_CST);
+                _wait_for_readers(r, phase);
+        }
+#endif
+        return true;
+}
+
+
+/**
+ * @}
+ */
@@ -0,0 +1,90 @@
+/*
+ * libniftyprefs - lightweight modelless preferences management library
+ * Copyright (C) 2006-2014 Daniel Hiepler <daniel@niftylight.de>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef _RCU_H
+#define _RCU_H
+
+
+#include <stdbool.h>
+
+
+/** read-copy-update state: readers announce themselves in one of two
+    counters, writers are serialized & wait until the readers that could
+    still see an old version are gone (sleepable RCU with two phases) */
+typedef struct
+{
+        /** counter new readers enter (0 or 1) */
+        unsigned int phase;
+        /** readers currently inside a read-side critical section per phase */
+        unsigned long readers[2];
+        /** true while a writer holds the write lock */
+        bool writer;
+} NftRcu;
+
+
+unsigned int                    _rcu_read_lock(NftRcu * r);
+void                            _rcu_read_unlock(NftRcu * r, unsigned int phase);
+void                            _rcu_write_lock(NftRcu * r);
+void                            _rcu_write_unlock(NftRcu * r);
+bool                            _rcu_synchronize(NftRcu * r);
+
+
+/** read pointer published by _RCU_ASSIGN() (inside a read-side critical
+    section). Sequentially consistent, so a writer that found no readers
+    can't be overtaken by a reader that still sees the old version */
+#ifdef __GNUC__
+#define _RCU_DEREFERENCE(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#else
+#define _RCU_DEREFERENCE(p) (*(p))
+#endif
+
+/** publish pointer to a fully initialized object */
+#ifdef __GNUC__
+#define _RCU_ASSIGN(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#else
+#define _RCU_ASSIGN(p, v) (*(p) = (v))
+#endif
+
+
+#endif /** _RCU_H */
@@ -56,6 +56,13 @@
 #include <niftylog.h>
 #include "prefs.h"
 #include "class.h"
+#include "updater.h"
+#include "allocator.h"
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 
 
@@ -77,41 +84,139 @@ struct _NftPrefsUpdater
 };
 
 
+/** updaters of one class to run between two versions, in order */
+struct _NftPrefsUpdatePlan
+{
+        /** next plan of the same class */
+        NftPrefsUpdatePlan *next;
+        /** version of nodes this plan updates */
+        unsigned int fromVersion;
+        /** version of nodes after running this plan */
+        unsigned int toVersion;
+        /** amount of steps */
+        size_t count;
+        /** copies of the updaters to run */
+        NftPrefsUpdater steps[];
+};
+
+
+
+/** version of the updaters of one class that readers use. Writers publish
+    a new version for every registered updater (s. _updater_publish()). */
+struct _NftPrefsUpdaterList
+{
+        /** update plans built from this version so far (s. _plan_get()) */
+        NftPrefsUpdatePlan *plans;
+        /** writer only: versions that were replaced but may still be used by
+            readers (each older one hangs off the garbage of the previous) */
+        NftPrefsUpdaterList *garbage;
+        /** amount of updaters */
+        size_t count;
+        /** copies of the updaters of the class sorted by version */
+        NftPrefsUpdater updaters[];
+};
+
 
 
 /******************************************************************************/
 /**************************** STATIC FUNCTIONS ********************************/
 /******************************************************************************/
 
-/** criterion for nft_array_find_slot() */
-static bool _finder_by_version(void *element,
-                                      void *criterion,
-                                      void *userptr)
+/** find index of first updater for version or a newer one */
+static size_t _find_updater(NftPrefsUpdaterList *l, unsigned int version)
 {
-        if(!element || !criterion)
-                NFT_LOG_NULL(false);
+        size_t lo = 0, hi = l->count;
+        while(lo < hi)
+        {
+                size_t mid = lo + (hi - lo) / 2;
+                if(l->updaters[mid].version < version)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+
+/** build plan to update nodes from one version to another */
+static NftPrefsUpdatePlan *_plan_build(NftPrefs *p, NftPrefsUpdaterList *l,
+                                       unsigned int fromVersion,
+                                       unsigned int toVersion)
+{
+        size_t first = _find_updater(l, fromVersion);
+
+        /* count one updater per version (first registered one wins) */
+        size_t steps = 0;
+        size_t s;
+        NftPrefsUpdater *u, *prev = NULL;
+        for(s = first; s < l->count; s++, prev = u)
+        {
+                u = &l->updaters[s];
+                if(u->version >= toVersion)
+                        break;
+                if(!prev || prev->version != u->version)
+                        steps++;
+        }
 
+        NftPrefsUpdatePlan *plan;
+        if(!(plan = _mem_alloc(_prefs_allocator(p), sizeof(NftPrefsUpdatePlan) +
+                               steps * sizeof(NftPrefsUpdater))))
+        {
+                NFT_LOG_PERROR("malloc()");
+                return NULL;
+        }
 
-        NftPrefsUpdater *u = element;
-		unsigned int *version = criterion;
+        plan->next = NULL;
+        plan->fromVersion = fromVersion;
+        plan->toVersion = toVersion;
+        plan->count = 0;
 
-        return (*version == u->version);
+        for(s = first, prev = NULL; plan->count < steps; s++, prev = u)
+        {
+                u = &l->updaters[s];
+                if(!prev || prev->version != u->version)
+                        plan->steps[plan->count++] = *u;
+        }
+
+        return plan;
 }
 
 
-/** find updater for a specific version */
-static NftPrefsUpdater *_find_updater(NftPrefsUpdaters *updaters, 
-                                      unsigned int version)
+/** get plan to update nodes using one version of the updaters of a class
+    (built once per pair of versions, call inside read-side critical
+    section) */
+static NftPrefsUpdatePlan *_plan_get(NftPrefs *p, NftPrefsUpdaterList *l,
+                                     unsigned int fromVersion,
+                                     unsigned int toVersion)
 {
-        /* find updater in array */
-        NftArraySlot slot;
-        if(!nft_array_find_slot(updaters, &slot, _finder_by_version,
-                                (void *) &version, NULL))
+        NftPrefsUpdatePlan **plans = &l->plans;
+
+        NftPrefsUpdatePlan *plan;
+        for(plan = _RCU_DEREFERENCE(plans); plan; plan = plan->next)
         {
-                return NULL;
+                if(plan->fromVersion == fromVersion &&
+                   plan->toVersion == toVersion)
+                        return plan;
         }
 
-        return nft_array_get_element(updaters, slot);
+        if(!(plan = _plan_build(p, l, fromVersion, toVersion)))
+                return NULL;
+
+        /* push new plan (another thread may push the same one, which only
+           costs memory until the plans are freed with l) */
+#ifdef HAVE_BUILTIN_ATOMIC
+        plan->next = __atomic_load_n(plans, __ATOMIC_ACQUIRE);
+        while(!__atomic_compare_exchange_n(plans, &plan->next, plan, true,
+                                           __ATOMIC_RELEASE,
+                                           __ATOMIC_ACQUIRE))
+                ;
+#else
+        plan->next = *plans;
+        *plans = plan;
+#endif
+
+        return plan;
 }
 
 
@@ -129,64 +234,324 @@ static NftResult _get_version(NftPrefsNode *node, unsigned int *version)
 }
 
 
-/** run updater for node, all siblings and all child nodes */
+/** run updaters of the class of node n (*descend is set to false if the
+    children of n must not be updated) */
+static NftResult _update_one(NftPrefs *p, NftPrefsNode *n,
+                             const NftPrefsClassSet *migrate,
+                             unsigned int fromVersion, unsigned int toVersion,
+                             bool *descend)
+{
+		/* find class */
+		NftPrefsClass *c;
+		if(!(c = _class_of_node(p, n)))
+		{
+				NFT_LOG(L_DEBUG, "Unknown prefs class \"%s\". Skipping...",
+						nft_prefs_node_get_name(n));
+
+				*descend = false;
+				return NFT_SUCCESS;
+		}
+
+		*descend = true;
+
+		/* get chain of updaters between both versions
+		   (versions without updater are skipped) */
+		NftPrefsUpdaterList *l;
+		if(!_class_in_set(migrate, c) ||
+		   !(l = _RCU_DEREFERENCE(_class_updater_list(c))))
+				return NFT_SUCCESS;
+
+		NftPrefsUpdatePlan *plan;
+		if(!(plan = _plan_get(p, l, fromVersion, toVersion)))
+				return NFT_FAILURE;
+
+		size_t i;
+		for(i = 0; i < plan->count; i++)
+		{
+				NftPrefsUpdater *u = &plan->steps[i];
+
+				NFT_LOG(L_DEBUG, "Found updater function for "
+							"class \"%s\" version \"%d\"",
+							u->className, u->version);
+
+				/* run updater */
+				uint64_t start = _class_stats_start(p);
+				NftResult r = u->updater(n, u->version, u->userptr);
+				_class_stats_end(&_class_stats(c)->updater, start, r);
+				if(!r)
+				{
+						NFT_LOG(L_ERROR, "Update for class \"%s\" "
+									"(from version %d) failed!",
+									u->className, u->version);
+						return NFT_FAILURE;
+				}
+
+				NFT_LOG(L_DEBUG, "Node \"%s\" successfully "
+							"updated to version %d",
+							u->className, u->version);
+		}
+
+		/* updaters may have renamed or added children */
+		if(plan->count)
+				_class_resolve_children(p, n, migrate);
+
+		return NFT_SUCCESS;
+}
+
+
+/** run updater for node, all siblings and all child nodes (skipping
+    subtrees _class_resolve_tree() found nothing to update in) */
 static NftResult _update_node(NftPrefs *p, NftPrefsNode *node,
+                              const NftPrefsClassSet *migrate,
                               unsigned int fromVersion, unsigned int toVersion)
 {
 		/* update this node and all siblings */
 		NftPrefsNode *n;
 		for(n = node; n; n = nft_prefs_node_get_next(n))
 		{
+				/* nothing to update in this subtree */
+				if(!_class_node_migrates(n))
+						continue;
 
-				/* find class */
-				NftPrefsClass *c;
-				if(!(c = _class_find_by_name(_prefs_classes(p),
-											 nft_prefs_node_get_name(n))))
+				bool descend;
+				if(!_update_one(p, n, migrate, fromVersion, toVersion, &descend))
+						return NFT_FAILURE;
+
+				/* update all child nodes */
+				NftPrefsNode *nc;
+				if(descend && (nc = nft_prefs_node_get_first_child(n)))
 				{
-						NFT_LOG(L_DEBUG, "Unknown prefs class \"%s\". Skipping...",
-								nft_prefs_node_get_name(n));
+							if(!(_update_node(p, nc, migrate, fromVersion,
+							                  toVersion)))
+							{
+									return NFT_FAILURE;
+							}
+				}
+		}
 
-						continue;
+		return NFT_SUCCESS;
+}
+
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_BUILTIN_ATOMIC)
+
+/** subtrees of one document shared by all updater threads */
+typedef struct
+{
+		NftPrefs *p;
+		const NftPrefsClassSet *migrate;
+		unsigned int fromVersion;
+		unsigned int toVersion;
+		/** top-level subtrees */
+		NftPrefsNode **nodes;
+		/** result per subtree */
+		NftResult *results;
+		/** amount of subtrees */
+		size_t count;
+		/** next subtree to update */
+		size_t next;
+		/** true once a subtree failed */
+		bool failed;
+		/** libxml2 error handler of the calling thread */
+		xmlGenericErrorFunc errorFunc;
+		void *errorContext;
+} UpdateJob;
+
+
+/** update subtrees of a job until none is left or one failed */
+static void *_update_worker(void *userptr)
+{
+		UpdateJob *job = userptr;
+
+		/* libxml2 error handlers are per thread */
+		xmlSetGenericErrorFunc(job->errorContext, job->errorFunc);
+
+		while(!__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+		{
+				/* subtrees are taken in order, so every subtree before a
+				   failed one gets updated (like when updating serially) */
+				size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+				if(i >= job->count)
+						break;
+
+				NftPrefsNode *n = job->nodes[i];
+				bool descend;
+				NftResult r = _update_one(job->p, n, job->migrate,
+				                          job->fromVersion, job->toVersion,
+				                          &descend);
+
+				NftPrefsNode *nc;
+				if(r && descend && (nc = nft_prefs_node_get_first_child(n)))
+						r = _update_node(job->p, nc, job->migrate,
+						                 job->fromVersion, job->toVersion);
+
+				if(!(job->results[i] = r))
+						__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+		}
+
+		return NULL;
+}
+
+
+/** update root node, then its top-level subtrees using multiple threads */
+static NftResult _update_parallel(NftPrefs *p, NftPrefsNode *root,
+                                  const NftPrefsClassSet *migrate,
+                                  unsigned int fromVersion,
+                                  unsigned int toVersion,
+                                  unsigned int threads)
+{
+		bool descend;
+		if(!_update_one(p, root, migrate, fromVersion, toVersion, &descend))
+				return NFT_FAILURE;
+
+		if(!descend)
+				return NFT_SUCCESS;
+
+		/* collect subtrees that need an update */
+		size_t count = 0;
+		NftPrefsNode *n;
+		for(n = nft_prefs_node_get_first_child(root); n;
+		    n = nft_prefs_node_get_next(n))
+		{
+				if(_class_node_migrates(n))
+						count++;
+		}
+
+		if(count < 2)
+				return _update_node(p, nft_prefs_node_get_first_child(root),
+				                    migrate, fromVersion, toVersion);
+
+		const NftAllocator *al = _prefs_allocator(p);
+		UpdateJob job = {
+				.p = p,
+				.migrate = migrate,
+				.fromVersion = fromVersion,
+				.toVersion = toVersion,
+				.count = count,
+				.errorFunc = xmlGenericError,
+				.errorContext = xmlGenericErrorContext,
+		};
+		pthread_t *workers = NULL;
+		if(!(job.nodes = _mem_calloc(al, count, sizeof(NftPrefsNode *))) ||
+		   !(job.results = _mem_calloc(al, count, sizeof(NftResult))) ||
+		   !(workers = _mem_calloc(al, threads, sizeof(pthread_t))))
+		{
+				NFT_LOG_PERROR("calloc()");
+				_mem_free(al, job.nodes);
+				_mem_free(al, job.results);
+				return NFT_FAILURE;
+		}
+
+		size_t i = 0;
+		for(n = nft_prefs_node_get_first_child(root); n;
+		    n = nft_prefs_node_get_next(n))
+		{
+				if(_class_node_migrates(n))
+				{
+						job.nodes[i] = n;
+						job.results[i++] = NFT_SUCCESS;
 				}
+		}
 
-				NFT_LOG(L_NOTICE, "Preferences older than context. Trying to update...");
+		/* calling thread is one of the workers */
+		if(threads > count)
+				threads = count;
 
-				/* update version succesively */
-				for(unsigned int v = fromVersion; v < toVersion; v++)
+		unsigned int started;
+		for(started = 0; started < threads - 1; started++)
+		{
+				if(pthread_create(&workers[started], NULL, _update_worker,
+				                  &job) != 0)
 				{
-						/* find updater */
-						NftPrefsUpdater *u;
-						if(!(u = _find_updater(_class_updaters(c), v)))
-						{
-								continue;
-						}
-
-						NFT_LOG(L_DEBUG, "Found updater function for "
-									"class \"%s\" version \"%d\"",
-									u->className, u->version);
+						NFT_LOG(L_WARNING, "Failed to start updater thread");
+						break;
+				}
+		}
+
+		_update_worker(&job);
+
+		unsigned int t;
+		for(t = 0; t < started; t++)
+				pthread_join(workers[t], NULL);
 
-						/* run updater */
-						if(!(u->updater(n, v, u->userptr)))
-						{
-								NFT_LOG(L_ERROR, "Update for class \"%s\" "
-											"(from version %d) failed!",
-											u->className, v);
-								return NFT_FAILURE;
-						}
-
-						NFT_LOG(L_NOTICE, "Node \"%s\" successfully "
-									"updated to version %d",
-									u->className, v);
+		/* report first subtree that failed (in document order) */
+		NftResult r = NFT_SUCCESS;
+		for(i = 0; i < count; i++)
+		{
+				if(!job.results[i])
+				{
+						NFT_LOG(L_ERROR, "Update of subtree %d (\"%s\") failed",
+						        (int) i, nft_prefs_node_get_name(job.nodes[i]));
+						r = NFT_FAILURE;
+						break;
 				}
+		}
 
-				/* update all child nodes */
-				NftPrefsNode *nc;
-				if((nc = nft_prefs_node_get_first_child(n)))
+		_mem_free(al, workers);
+		_mem_free(al, job.nodes);
+		_mem_free(al, job.results);
+
+		return r;
+}
+
+
+/** check if updaters of all classes in migrate may run in parallel */
+static bool _all_threadsafe(NftPrefs *p, const NftPrefsClassSet *migrate)
+{
+		/* classes registered meanwhile are members of migrate, too */
+		size_t slots = _class_slots(p);
+
+		NftArraySlot s;
+		for(s = 0; s < slots; s++)
+		{
+				NftPrefsClass *c;
+				if((c = _class_at(p, s)) && _class_in_set(migrate, c) &&
+				   !_class_threadsafe(c))
+						return false;
+		}
+
+		return true;
+}
+
+#endif /* HAVE_PTHREAD && HAVE_BUILTIN_ATOMIC */
+
+
+/** get set of all classes that have updaters between two versions (free
+    set->bits afterwards) */
+static NftResult _migrating_classes(NftPrefs *p, unsigned int fromVersion,
+                                    unsigned int toVersion,
+                                    NftPrefsClassSet *set, bool *any)
+{
+		set->slots = _class_slots(p);
+		if(!(set->bits = _mem_calloc(_prefs_allocator(p), set->slots / 64 + 1,
+		                             sizeof(uint64_t))))
+		{
+				NFT_LOG_PERROR("calloc()");
+				return NFT_FAILURE;
+		}
+
+		*any = false;
+
+		NftArraySlot s;
+		for(s = 0; s < set->slots; s++)
+		{
+				NftPrefsClass *c;
+				NftPrefsUpdaterList *l;
+				if(!(c = _class_at(p, s)) ||
+				   !(l = _RCU_DEREFERENCE(_class_updater_list(c))))
+						continue;
+
+				NftPrefsUpdatePlan *plan;
+				if(!(plan = _plan_get(p, l, fromVersion, toVersion)))
 				{
-							if(!(_update_node(p, nc, fromVersion, toVersion)))
-							{
-									return NFT_FAILURE;
-							}
+						_mem_free(_prefs_allocator(p), set->bits);
+						return NFT_FAILURE;
+				}
+
+				if(plan->count)
+				{
+						set->bits[s / 64] |= (uint64_t) 1 << (s % 64);
+						*any = true;
 				}
 		}
 
@@ -194,23 +559,169 @@ static NftResult _update_node(NftPrefs *p, NftPrefsNode *node,
 }
 
 
+/** register updater (call with write lock held) */
+static NftResult _updater_register(NftPrefs *p,
+                                   NftPrefsUpdaterFunc *updater,
+                                   const char *className,
+                                   unsigned int version, void *userptr)
+{
+	if(_prefs_is_frozen(p))
+			return NFT_FAILURE;
+
+	/* get class */
+	NftPrefsClass *c;
+	if(!(c = _class_find_by_name(p, className)))
+	{
+			NFT_LOG(L_ERROR, "Class \"%s\" not registered", className);
+			return NFT_FAILURE;
+	}
+
+	if(!_updater_add(c, updater, version, userptr))
+			return NFT_FAILURE;
+
+	/* make updater visible to readers */
+	return _updater_publish(p, c);
+}
+
+
 
 /******************************************************************************/
 /**************************** PRIVATE FUNCTIONS *******************************/
 /******************************************************************************/
 
+/** add updater to a class (call with write lock held) */
+NftResult _updater_add(NftPrefsClass *c, NftPrefsUpdaterFunc *updater,
+                       unsigned int version, void *userptr)
+{
+	/* allocate new slot in updater array */
+    NftArraySlot s;
+    if(!(nft_array_slot_alloc(_class_updaters(c), &s)))
+    {
+            NFT_LOG(L_ERROR, "Failed to allocate new array slot");
+            return NFT_FAILURE;
+    }
+
+    /* get newly allocated empty array element */
+    NftPrefsUpdater *n;
+    if(!(n = nft_array_get_element(_class_updaters(c), s)))
+    {
+            NFT_LOG(L_ERROR, "Failed to get element from array slot");
+			nft_array_slot_free(_class_updaters(c), s);
+            return NFT_FAILURE;
+    }
+
+	/* keep array sorted by version: move newer updaters up one slot
+	   (updaters of the same version keep their order of registration) */
+	NftPrefsUpdaters *a = _class_updaters(c);
+	for(; s > 0; s--)
+	{
+			NftPrefsUpdater *prev = nft_array_get_element(a, s - 1);
+			if(prev->version <= version)
+					break;
+
+			*n = *prev;
+			n = prev;
+	}
+
+	/* register updater */
+	n->updater = updater;
+	n->version = version;
+	n->userptr = userptr;
+	strncpy(n->className, _class_name(c), NFT_PREFS_MAX_CLASSNAME);
+
+	return NFT_SUCCESS;
+}
+
+
+/**
+ * publish new version of the updaters of a class after updaters were added
+ * (call with write lock held). Plans built from the old version are freed
+ * with it once no reader uses it anymore.
+ *
+ * @param p NftPrefs context
+ * @param c class
+ * @result NFT_SUCCESS or NFT_FAILURE
+ */
+NftResult _updater_publish(NftPrefs *p, NftPrefsClass *c)
+{
+        NftPrefsUpdaters *updaters = _class_updaters(c);
+        size_t count = nft_array_get_elementcount(updaters);
+
+        NftPrefsUpdaterList *l;
+        if(!(l = _mem_alloc(_prefs_allocator(p), sizeof(NftPrefsUpdaterList) +
+                            count * sizeof(NftPrefsUpdater))))
+        {
+                NFT_LOG_PERROR("malloc()");
+                return NFT_FAILURE;
+        }
+
+        /* updaters are sorted & never freed, so slots 0..count-1 are used */
+        l->plans = NULL;
+        l->count = count;
+        size_t s;
+        for(s = 0; s < count; s++)
+                l->updaters[s] = *(NftPrefsUpdater *)
+                        nft_array_get_element(updaters, s);
+
+        NftPrefsUpdaterList **list = _class_updater_list(c);
+        l->garbage = *list;
+        _RCU_ASSIGN(list, l);
+
+        /* free old versions if readers are done with them (otherwise the
+           next writer will) */
+        if(l->garbage && _rcu_synchronize(_prefs_rcu(p)))
+        {
+                _updater_list_free(p, l->garbage);
+                l->garbage = NULL;
+        }
+
+        return NFT_SUCCESS;
+}
+
+
+/** free a version of the updaters of a class, its plans & all versions it
+    replaced (no reader may use them anymore) */
+void _updater_list_free(NftPrefs *p, NftPrefsUpdaterList *l)
+{
+        while(l)
+        {
+                NftPrefsUpdaterList *garbage = l->garbage;
+
+                NftPrefsUpdatePlan *plan = l->plans;
+                while(plan)
+                {
+                        NftPrefsUpdatePlan *next = plan->next;
+                        _mem_free(_prefs_allocator(p), plan);
+                        plan = next;
+                }
+
+                _mem_free(_prefs_allocator(p), l);
+                l = garbage;
+        }
+}
+
+
 /** initialize array to store updaters */
-NftResult _updater_init_array(NftPrefsUpdaters * a)
+NftResult _updater_init_array(NftPrefsUpdaters * a, const NftAllocator * allocator)
 {
 		/* initialize class-array */
-        return nft_array_init(a, sizeof(NftPrefsUpdater));
+        if(!nft_array_init(a, sizeof(NftPrefsUpdater)))
+                return NFT_FAILURE;
+
+        return nft_array_set_allocator(a, allocator);
 }
 
 
-/** update a node that has a version property,
-    all its siblings & all child nodes recursively */
-NftResult _updater_node_process(NftPrefs *p, NftPrefsNode *node)
+/** cache classes of a freshly parsed document (s. _class_resolve_tree()) &
+    update a node that has a version property, all its siblings & all child
+    nodes recursively (call inside read-side critical section). *migrated
+    (if not NULL) tells whether an updater ran */
+NftResult _updater_node_process(NftPrefs *p, NftPrefsNode *node,
+                                bool *migrated)
 {
+		if(migrated)
+				*migrated = false;
+
 		/* get version of context */
 		unsigned int contextVersion = _prefs_get_version(p);
 
@@ -219,6 +730,7 @@ NftResult _updater_node_process(NftPrefs *p, NftPrefsNode *node)
 		if(!_get_version(node, &nodeVersion))
 		{
 				/* no version found */
+				_class_resolve_tree(p, node, NULL);
 				return NFT_SUCCESS;
 		}
 
@@ -226,6 +738,7 @@ NftResult _updater_node_process(NftPrefs *p, NftPrefsNode *node)
 		if(contextVersion == nodeVersion)
 		{
 				/* same version - no update required */
+				_class_resolve_tree(p, node, NULL);
 				return NFT_SUCCESS;
 		}
 
@@ -235,17 +748,57 @@ NftResult _updater_node_process(NftPrefs *p, NftPrefsNode *node)
 				NFT_LOG(L_WARNING, "Preferences are newer than we are! "
 				        "Please update application. "
 				        "Trying to continue anyway...");
+				_class_resolve_tree(p, node, NULL);
 				return NFT_SUCCESS;
 		}
 
 
-		/* update node and all child nodes */
-		if(!_update_node(p, node, nodeVersion, contextVersion))
-		{
+		/* classes that have updaters for this document */
+		bool any;
+		NftPrefsClassSet set;
+		if(!_migrating_classes(p, nodeVersion, contextVersion, &set, &any))
 				return NFT_FAILURE;
+
+		/* find nodes of those classes */
+		const NftPrefsClassSet *migrate = any ? &set : NULL;
+		if(!_class_resolve_tree(p, node, migrate))
+		{
+				NFT_LOG(L_DEBUG, "Nothing to update from version %d to %d",
+				        nodeVersion, contextVersion);
+				_mem_free(_prefs_allocator(p), set.bits);
+				return NFT_SUCCESS;
 		}
 
-		return NFT_SUCCESS;
+		NFT_LOG(L_DEBUG, "Preferences older than context. Trying to update...");
+
+		/* update node and all child nodes */
+		NftResult r;
+#if defined(HAVE_PTHREAD) && defined(HAVE_BUILTIN_ATOMIC)
+		unsigned int threads = _prefs_update_threads(p);
+		if(threads > 1 && _class_node_migrates(node) &&
+		   _all_threadsafe(p, migrate))
+				r = _update_parallel(p, node, migrate, nodeVersion,
+				                     contextVersion, threads);
+		else
+#endif
+				r = _update_node(p, node, migrate, nodeVersion, contextVersion);
+
+		_mem_free(_prefs_allocator(p), set.bits);
+
+		/* node has the version of the context now */
+		if(r && !(r = _updater_node_add_version(p, node)))
+				NFT_LOG(L_ERROR, "failed to set version of updated node");
+
+		/* one summary per document (single nodes are logged as L_DEBUG) */
+		if(r)
+				NFT_LOG(L_NOTICE, "Preferences \"%s\" updated from version "
+				        "%d to %d", nft_prefs_node_get_name(node),
+				        nodeVersion, contextVersion);
+
+		if(r && migrated)
+				*migrated = true;
+
+		return r;
 }
 
 
@@ -294,6 +847,9 @@ void _updater_node_remove_version(NftPrefsNode *node)
  * @param version update nodes with this version (to version+1)
  * @param userptr arbitrary pointer that will be passed to the updater function
  * @result NFT_SUCCESS or NFT_FAILURE
+ * @note Updaters may be registered while other threads parse preferences
+ *       using p. Nodes they're updating meanwhile may or may not be updated
+ *       by the new updater.
  */
 NftResult nft_prefs_updater_register(NftPrefs *p,
                                      NftPrefsUpdaterFunc *updater,
@@ -304,42 +860,90 @@ NftResult nft_prefs_updater_register(NftPrefs *p,
 			NFT_LOG_NULL(NFT_FAILURE);
 
 
-	/* get class */
+	_rcu_write_lock(_prefs_rcu(p));
+	NftResult r = _updater_register(p, updater, className, version, userptr);
+	_rcu_write_unlock(_prefs_rcu(p));
+
+	return r;
+}
+
+
+
+/**
+ * declare whether all updaters of a class may run at the same time for
+ * different nodes (i.e. they only touch the node they were called for and
+ * its children). Only needed for nft_prefs_updater_set_threads().
+ *
+ * @param p NftPrefs context
+ * @param className class of nodes the updaters handle
+ * @param threadsafe true if updaters of the class are thread-safe
+ * @result NFT_SUCCESS or NFT_FAILURE
+ * @note this is part of the registry, so it fails after nft_prefs_freeze()
+ */
+NftResult nft_prefs_updater_set_threadsafe(NftPrefs *p, const char *className,
+                                           bool threadsafe)
+{
+	if(!p || !className)
+			NFT_LOG_NULL(NFT_FAILURE);
+
+	NftResult r = NFT_FAILURE;
+
+	_rcu_write_lock(_prefs_rcu(p));
+
+	if(_prefs_is_frozen(p))
+			goto _pust_exit;
+
 	NftPrefsClass *c;
-	if(!(c = _class_find_by_name(_prefs_classes(p), className)))
+	if(!(c = _class_find_by_name(p, className)))
 	{
 			NFT_LOG(L_ERROR, "Class \"%s\" not registered", className);
-			return NFT_FAILURE;
+			goto _pust_exit;
 	}
 
-	/* allocate new slot in updater array */
-    NftArraySlot s;
-    if(!(nft_array_slot_alloc(_class_updaters(c), &s)))
-    {
-            NFT_LOG(L_ERROR, "Failed to allocate new array slot");
-            return NFT_FAILURE;
-    }
+	_class_set_threadsafe(c, threadsafe);
+	r = NFT_SUCCESS;
 
-    /* get newly allocated empty array element */
-    NftPrefsUpdater *n;
-    if(!(n = nft_array_get_element(_class_updaters(c), s)))
-    {
-            NFT_LOG(L_ERROR, "Failed to get element from array slot");
-			nft_array_slot_free(_class_updaters(c), s);
-            return NFT_FAILURE;
-    }
+_pust_exit:
+	_rcu_write_unlock(_prefs_rcu(p));
 
-	/* register updater */
-	n->updater = updater;
-	n->version = version;
-	n->userptr = userptr;
-	strncpy(n->className, className, NFT_PREFS_MAX_CLASSNAME);
+	return r;
+}
+
+
+/**
+ * update documents parsed by this context using multiple threads. The
+ * top-level subtrees (children of the root node) of a document are then
+ * distributed among the threads, if all classes that need an update have
+ * thread-safe updaters (s. nft_prefs_updater_set_threadsafe()). Otherwise
+ * documents are updated by the calling thread as usual.
+ * If subtrees fail, the first one of them in document order is reported.
+ *
+ * @param p NftPrefs context
+ * @param threads maximum amount of threads per document (0 or 1 to update
+ *        serially)
+ * @result NFT_SUCCESS or NFT_FAILURE if threads aren't supported
+ * @note documents are parsed without libxml2 name dictionary while more than
+ *       one thread is used
+ */
+NftResult nft_prefs_updater_set_threads(NftPrefs *p, unsigned int threads)
+{
+	if(!p)
+			NFT_LOG_NULL(NFT_FAILURE);
+
+#if !defined(HAVE_PTHREAD) || !defined(HAVE_BUILTIN_ATOMIC)
+	if(threads > 1)
+	{
+			NFT_LOG(L_ERROR, "niftyprefs was built without thread support");
+			return NFT_FAILURE;
+	}
+#endif
+
+	_prefs_set_update_threads(p, threads);
 
 	return NFT_SUCCESS;
 }
 
 
-
 /**
  * @}
  */
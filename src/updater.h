@@ -46,13 +46,17 @@
 
 
 #include "niftyprefs.h"
+#include "class.h"
 
 
 
-NftResult  _updater_init_array(NftPrefsUpdaters * a);
-NftResult  _updater_node_process(NftPrefs *p, NftPrefsNode *node);
+NftResult  _updater_init_array(NftPrefsUpdaters * a, const NftAllocator * allocator);
+NftResult  _updater_node_process(NftPrefs *p, NftPrefsNode *node, bool *migrated);
 NftResult  _updater_node_add_version(NftPrefs *p, NftPrefsNode *node);
 void       _updater_node_remove_version(NftPrefsNode *node);
+NftResult  _updater_add(NftPrefsClass *c, NftPrefsUpdaterFunc *updater, unsigned int version, void *userptr);
+NftResult  _updater_publish(NftPrefs *p, NftPrefsClass *c);
+void       _updater_list_free(NftPrefs *p, NftPrefsUpdaterList *l);
 
 
 #endif /** _UPDATER_H */
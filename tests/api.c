@@ -43,11 +43,1172 @@
 
 
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <niftylog.h>
 #include <niftyprefs.h>
 
 
 #define OBJNUM 1024
+/** amount of threads looking up classes while another one changes them */
+#define READERS 4
+/** amount of classes registered & unregistered while readers are running */
+#define WRITES 2000
+/** amount of lookups each thread does while the registry changes */
+#define LOOKUPS 2000
+
+/** amount of top-level subtrees updated in parallel */
+#define SUBTREES 32
+
+/** file written by writeback test */
+#define WRITEBACK_FILE "test-writeback.xml"
+
+/** file behind symlink written by writeback test */
+#define WRITEBACK_TARGET "test-writeback-target.xml"
+
+/** amount of contexts sharing one registry */
+#define SHARED 4
+
+
+/** allocator that counts live blocks */
+static void *_counting_alloc(size_t size, void *userptr)
+{
+        (*(int *) userptr)++;
+        return malloc(size);
+}
+
+
+/** allocator that counts live blocks */
+static void *_counting_realloc(void *ptr, size_t size, void *userptr)
+{
+        if(!ptr)
+                (*(int *) userptr)++;
+        return realloc(ptr, size);
+}
+
+
+/** allocator that counts live blocks */
+static void _counting_free(void *ptr, void *userptr)
+{
+        (*(int *) userptr)--;
+        free(ptr);
+}
+
+
+/** updater that never runs */
+static NftResult _noop_updater(NftPrefsNode * node, unsigned int version,
+                               void *userptr)
+{
+        return NFT_SUCCESS;
+}
+
+
+/** versions of updaters in order of their calls */
+struct UpdateLog
+{
+        unsigned int versions[8];
+        int count;
+};
+
+
+/** updater that appends its version to a log */
+static NftResult _logging_updater(NftPrefsNode * node, unsigned int version,
+                                  void *userptr)
+{
+        struct UpdateLog *log = userptr;
+
+        if(log->count >= 8)
+                return NFT_FAILURE;
+
+        log->versions[log->count++] = version;
+        return NFT_SUCCESS;
+}
+
+
+/** thread-safe updater that marks its node (and fails if told so) */
+static NftResult _marking_updater(NftPrefsNode * node, unsigned int version,
+                                  void *userptr)
+{
+        bool fail;
+        if(nft_prefs_node_prop_boolean_get(node, "fail", &fail) && fail)
+                return NFT_FAILURE;
+
+        return nft_prefs_node_prop_int_set(node, "migrated", version);
+}
+
+
+/** count updater calls of class "hw" */
+static void _hw_stats(const char *className,
+                      const NftPrefsClassStats * stats, void *userptr)
+{
+        if(strcmp(className, "hw") == 0)
+                *(uint64_t *) userptr = stats->updater.calls;
+}
+
+
+/** updater of "parent" that renames its <old> child & adds another one */
+static NftResult _restructuring_updater(NftPrefsNode * node,
+                                        unsigned int version, void *userptr)
+{
+        NftPrefsNode *old;
+        if(!(old = nft_prefs_node_get_first_child(node)))
+                return NFT_FAILURE;
+
+        xmlNodeSetName(old, BAD_CAST "new");
+
+        NftPrefsNode *n;
+        if(!(n = nft_prefs_node_alloc("new")))
+                return NFT_FAILURE;
+
+        return nft_prefs_node_add_child(node, n);
+}
+
+
+/** object of class "stable" is the node itself */
+static NftResult _stable_to_obj(NftPrefs * p, void **newObj,
+                                NftPrefsNode * node, void *userptr)
+{
+        *newObj = node;
+        return NFT_SUCCESS;
+}
+
+
+/** objects of all classes are stored as empty nodes */
+static NftResult _empty_from_obj(NftPrefs * p, NftPrefsNode * newNode,
+                                 void *obj, void *userptr)
+{
+        return NFT_SUCCESS;
+}
+
+
+/** object of re-registered class "stable" is the userptr */
+static NftResult _userptr_to_obj(NftPrefs * p, void **newObj,
+                                 NftPrefsNode * node, void *userptr)
+{
+        *newObj = userptr;
+        return NFT_SUCCESS;
+}
+
+
+/** remember counters of class "stable" */
+static void _stable_stats(const char *className,
+                          const NftPrefsClassStats * stats, void *userptr)
+{
+        if(strcmp(className, "stable") == 0)
+                *(NftPrefsClassStats *) userptr = *stats;
+}
+
+
+/** one thread of registry test */
+struct Reader
+{
+        pthread_t thread;
+        NftPrefs *p;
+        bool *stop;
+        bool ok;
+};
+
+
+/** look up classes until told to stop */
+static void *_registry_reader(void *userptr)
+{
+        struct Reader *r = userptr;
+
+        /* one parsed (cached classes) & one allocated node */
+        char xml[] = "<stable/>";
+        NftPrefsNode *parsed, *allocated;
+        if(!(parsed = nft_prefs_node_from_buffer(r->p, xml, strlen(xml))))
+                return NULL;
+        if(!(allocated = nft_prefs_node_alloc("stable")))
+        {
+                nft_prefs_node_free(parsed);
+                return NULL;
+        }
+
+        r->ok = true;
+        while(r->ok && !__atomic_load_n(r->stop, __ATOMIC_ACQUIRE))
+        {
+                if(nft_prefs_obj_from_node(r->p, parsed, NULL) != parsed ||
+                   nft_prefs_obj_from_node(r->p, allocated, NULL) != allocated
+                   || nft_prefs_class_get_handle(r->p, "stable") ==
+                   NFT_PREFS_CLASS_ID_INVALID)
+                        r->ok = false;
+        }
+
+        nft_prefs_node_free(allocated);
+        nft_prefs_node_free(parsed);
+        return NULL;
+}
+
+
+/** classes can be registered & unregistered while other threads use them */
+static NftResult _test_registry(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(0)))
+                return NFT_FAILURE;
+
+        if(!nft_prefs_class_register(p, "stable", _stable_to_obj, NULL))
+                goto _tr_exit;
+
+        bool stop = false;
+        struct Reader r[READERS];
+        int t;
+        for(t = 0; t < READERS; t++)
+        {
+                r[t].p = p;
+                r[t].stop = &stop;
+                r[t].ok = false;
+                if(pthread_create(&r[t].thread, NULL, _registry_reader,
+                                  &r[t]) != 0)
+                {
+                        NFT_LOG_PERROR("pthread_create()");
+                        __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+                        while(t-- > 0)
+                                pthread_join(r[t].thread, NULL);
+                        goto _tr_exit;
+                }
+        }
+
+        /* every change publishes a new version of the registry & frees
+           the old one once the readers are done with it */
+        bool ok = true;
+        int i;
+        for(i = 0; i < WRITES; i++)
+        {
+                char cName[64];
+                snprintf(cName, sizeof(cName), "volatile.%d", i % 16);
+                if(i % 32 < 16)
+                        ok &= nft_prefs_class_register(p, cName, NULL, NULL);
+                else
+                        nft_prefs_class_unregister(p, cName);
+        }
+
+        __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+        for(t = 0; t < READERS; t++)
+        {
+                pthread_join(r[t].thread, NULL);
+                ok &= r[t].ok;
+        }
+
+        if(!ok)
+        {
+                NFT_LOG(L_ERROR, "concurrent class lookup failed");
+                goto _tr_exit;
+        }
+
+        res = NFT_SUCCESS;
+
+_tr_exit:
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** classes cached in parsed nodes must not outlive their class */
+static NftResult _test_node_cache(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(0)))
+                return NFT_FAILURE;
+
+        /* put "stable" behind a chunk of other classes */
+        int i;
+        for(i = 0; i < NFT_ARRAY_CHUNK_SIZE; i++)
+        {
+                char cName[16];
+                snprintf(cName, sizeof(cName), "filler.%d", i);
+                if(!nft_prefs_class_register(p, cName, NULL, NULL))
+                        goto _tnc_exit;
+        }
+
+        if(!nft_prefs_class_register(p, "stable", _stable_to_obj, NULL))
+                goto _tnc_exit;
+
+        char xml[] = "<stable/>";
+        NftPrefsNode *n;
+        if(!(n = nft_prefs_node_from_buffer(p, xml, strlen(xml))))
+                goto _tnc_exit;
+
+        if(nft_prefs_obj_from_node(p, n, NULL) != n)
+                goto _tnc_free;
+
+        /* reuse slot of "stable" for another class & register it again */
+        nft_prefs_class_unregister(p, "stable");
+        int marker;
+        if(!nft_prefs_class_register(p, "dummy", NULL, NULL) ||
+           !nft_prefs_class_register(p, "stable", _userptr_to_obj, NULL))
+                goto _tnc_free;
+
+        if(nft_prefs_obj_from_node(p, n, &marker) != &marker)
+        {
+                NFT_LOG(L_ERROR, "parsed node kept unregistered class");
+                goto _tnc_free;
+        }
+
+        /* release the chunk the node cached its class in */
+        for(i = 0; i < NFT_ARRAY_CHUNK_SIZE; i++)
+        {
+                char cName[16];
+                snprintf(cName, sizeof(cName), "filler.%d", i);
+                nft_prefs_class_unregister(p, cName);
+        }
+
+        if(!nft_prefs_class_compact(p) ||
+           nft_prefs_obj_from_node(p, n, &marker) != &marker)
+        {
+                NFT_LOG(L_ERROR, "parsed node kept compacted class");
+                goto _tnc_free;
+        }
+
+        res = NFT_SUCCESS;
+
+_tnc_free:
+        nft_prefs_node_free(n);
+_tnc_exit:
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** callbacks are counted while statistics are enabled */
+static NftResult _test_stats(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(1)))
+                return NFT_FAILURE;
+
+        if(!nft_prefs_class_register(p, "stable", _stable_to_obj,
+                                     _empty_from_obj) ||
+           !nft_prefs_updater_register(p, _noop_updater, "stable", 0, NULL))
+                goto _ts_exit;
+
+        /* updates are not counted yet */
+        char xml[] = "<stable version=\"0\"><stable/></stable>";
+        NftPrefsNode *n;
+        if(!(n = nft_prefs_node_from_buffer(p, xml, strlen(xml))))
+                goto _ts_exit;
+        nft_prefs_node_free(n);
+
+        nft_prefs_class_stats_enable(p, true);
+
+        /* 2 updates, 1 toObj & 1 fromObj call */
+        int obj;
+        NftPrefsNode *o;
+        if(!(n = nft_prefs_node_from_buffer(p, xml, strlen(xml))))
+                goto _ts_exit;
+        if(nft_prefs_obj_from_node(p, n, NULL) != n ||
+           !(o = nft_prefs_obj_to_node(p, "stable", &obj, NULL)))
+                goto _ts_free;
+        nft_prefs_node_free(o);
+
+        NftPrefsClassStats stats;
+        memset(&stats, 0, sizeof(stats));
+        nft_prefs_class_stats_foreach(p, _stable_stats, &stats);
+        if(stats.updater.calls != 2 || stats.toObj.calls != 1 ||
+           stats.fromObj.calls != 1 || stats.nodes != 1 ||
+           stats.toObj.failures || stats.fromObj.failures ||
+           stats.updater.failures)
+        {
+                NFT_LOG(L_ERROR,
+                        "counted %d updates, %d toObj & %d fromObj calls",
+                        (int) stats.updater.calls, (int) stats.toObj.calls,
+                        (int) stats.fromObj.calls);
+                goto _ts_free;
+        }
+
+        res = NFT_SUCCESS;
+
+_ts_free:
+        nft_prefs_node_free(n);
+_ts_exit:
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** objects can be converted by class id */
+static NftResult _test_by_id(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(0)))
+                return NFT_FAILURE;
+
+        if(!nft_prefs_class_register(p, "stable", _stable_to_obj,
+                                     _empty_from_obj) ||
+           !nft_prefs_class_register(p, "other", _stable_to_obj,
+                                     _empty_from_obj))
+                goto _tbi_exit;
+
+        NftPrefsClassId stable, other;
+        if((stable = nft_prefs_class_get_handle(p, "stable")) ==
+           NFT_PREFS_CLASS_ID_INVALID ||
+           (other = nft_prefs_class_get_handle(p, "other")) ==
+           NFT_PREFS_CLASS_ID_INVALID || stable == other)
+                goto _tbi_exit;
+
+        int obj;
+        NftPrefsNode *n;
+        if(!(n = nft_prefs_obj_to_node_by_id(p, stable, &obj, NULL)))
+                goto _tbi_exit;
+
+        if(strcmp(nft_prefs_node_get_name(n), "stable") != 0 ||
+           nft_prefs_obj_from_node_by_id(p, stable, n, NULL) != n)
+        {
+                NFT_LOG(L_ERROR, "conversion by id failed");
+                nft_prefs_node_free(n);
+                goto _tbi_exit;
+        }
+
+        /* ids must match the class of the node */
+        NFT_LOG(L_INFO, "==== IGNORE ERROR MESSAGES ====");
+        if(nft_prefs_obj_from_node_by_id(p, other, n, NULL) ||
+           nft_prefs_obj_from_node_by_id(p, NFT_PREFS_CLASS_ID_INVALID, n,
+                                         NULL) ||
+           nft_prefs_obj_to_node_by_id(p, NFT_PREFS_CLASS_ID_INVALID, &obj,
+                                       NULL))
+        {
+                NFT_LOG(L_ERROR, "invalid class id accepted");
+                nft_prefs_node_free(n);
+                goto _tbi_exit;
+        }
+        NFT_LOG(L_INFO, "==== END IGNORING ERROR MESSAGES ====");
+
+        nft_prefs_node_free(n);
+
+        /* parsed nodes get compared by the class cached while parsing */
+        char xml[] = "<stable/>";
+        if(!(n = nft_prefs_node_from_buffer(p, xml, strlen(xml))))
+                goto _tbi_exit;
+
+        NFT_LOG(L_INFO, "==== IGNORE ERROR MESSAGES ====");
+        if(nft_prefs_obj_from_node_by_id(p, stable, n, NULL) != n ||
+           nft_prefs_obj_from_node_by_id(p, other, n, NULL))
+        {
+                NFT_LOG(L_ERROR, "conversion of parsed node by id failed");
+                nft_prefs_node_free(n);
+                goto _tbi_exit;
+        }
+        NFT_LOG(L_INFO, "==== END IGNORING ERROR MESSAGES ====");
+
+        nft_prefs_node_free(n);
+        res = NFT_SUCCESS;
+
+_tbi_exit:
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** ids of classes moved or dropped by compaction must stay invalid */
+static NftResult _test_compact_ids(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(0)))
+                return NFT_FAILURE;
+
+        int i;
+        for(i = 0; i < 200; i++)
+        {
+                char cName[16];
+                snprintf(cName, sizeof(cName), "c%d", i);
+                if(!nft_prefs_class_register(p, cName, NULL, _empty_from_obj))
+                        goto _tci_exit;
+        }
+
+        NftPrefsClassId stale;
+        if((stale = nft_prefs_class_get_handle(p, "c150")) ==
+           NFT_PREFS_CLASS_ID_INVALID)
+                goto _tci_exit;
+
+        /* drop the upper classes & fill their slots with new ones */
+        for(i = 50; i < 200; i++)
+        {
+                char cName[16];
+                snprintf(cName, sizeof(cName), "c%d", i);
+                nft_prefs_class_unregister(p, cName);
+        }
+
+        if(!nft_prefs_class_compact(p))
+                goto _tci_exit;
+
+        for(i = 0; i < 200; i++)
+        {
+                char cName[16];
+                snprintf(cName, sizeof(cName), "n%d", i);
+                if(!nft_prefs_class_register(p, cName, NULL, _empty_from_obj))
+                        goto _tci_exit;
+        }
+
+        NFT_LOG(L_INFO, "==== IGNORE ERROR MESSAGES ====");
+        NftPrefsNode *n;
+        if((n = nft_prefs_obj_to_node_by_id(p, stale, NULL, NULL)))
+        {
+                NFT_LOG(L_ERROR, "stale id resolved to class \"%s\"",
+                        nft_prefs_node_get_name(n));
+                nft_prefs_node_free(n);
+                goto _tci_exit;
+        }
+        NFT_LOG(L_INFO, "==== END IGNORING ERROR MESSAGES ====");
+
+        res = NFT_SUCCESS;
+
+_tci_exit:
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** thread doing a fixed amount of work while the registry changes */
+struct BoundedReader
+{
+        pthread_t thread;
+        NftPrefs *p;
+        int *done;
+};
+
+
+/** look up id of class "top" a couple of times */
+static void *_handle_reader(void *userptr)
+{
+        struct BoundedReader *r = userptr;
+
+        int i;
+        for(i = 0; i < LOOKUPS; i++)
+                nft_prefs_class_get_handle(r->p, "top");
+
+        __atomic_add_fetch(r->done, 1, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+
+/** ids can be looked up while their class is unregistered */
+static NftResult _test_handle_race(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(0)))
+                return NFT_FAILURE;
+
+        /* "top" occupies the highest slot */
+        if(!nft_prefs_class_register(p, "bottom", NULL, NULL) ||
+           !nft_prefs_class_register(p, "top", NULL, NULL))
+                goto _thr_exit;
+
+        NFT_LOG(L_INFO, "==== IGNORE ERROR MESSAGES ====");
+        int done = 0;
+        struct BoundedReader r[READERS];
+        int t;
+        for(t = 0; t < READERS; t++)
+        {
+                r[t].p = p;
+                r[t].done = &done;
+                if(pthread_create(&r[t].thread, NULL, _handle_reader,
+                                  &r[t]) != 0)
+                {
+                        NFT_LOG_PERROR("pthread_create()");
+                        while(t-- > 0)
+                                pthread_join(r[t].thread, NULL);
+                        goto _thr_exit;
+                }
+        }
+
+        /* every unregistration publishes a registry with fewer slots */
+        bool ok = true;
+        while(__atomic_load_n(&done, __ATOMIC_ACQUIRE) < READERS)
+        {
+                nft_prefs_class_unregister(p, "top");
+                ok &= nft_prefs_class_register(p, "top", NULL, NULL);
+        }
+
+        for(t = 0; t < READERS; t++)
+                pthread_join(r[t].thread, NULL);
+        NFT_LOG(L_INFO, "==== END IGNORING ERROR MESSAGES ====");
+
+        if(!ok || nft_prefs_class_get_handle(p, "top") ==
+           NFT_PREFS_CLASS_ID_INVALID)
+        {
+                NFT_LOG(L_ERROR, "class id lookup raced with unregistration");
+                goto _thr_exit;
+        }
+
+        res = NFT_SUCCESS;
+
+_thr_exit:
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** update a couple of documents (parsing errors are counted in done as
+    well, so the test notices them) */
+static void *_updating_reader(void *userptr)
+{
+        struct BoundedReader *r = userptr;
+
+        char xml[] = "<racy version=\"0\"/>";
+
+        int i, failed = 0;
+        for(i = 0; i < LOOKUPS; i++)
+        {
+                NftPrefsNode *n;
+                if(!(n = nft_prefs_node_from_buffer(r->p, xml, strlen(xml))))
+                        failed = READERS;
+                else
+                        nft_prefs_node_free(n);
+        }
+
+        __atomic_add_fetch(r->done, 1 + failed, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+
+/** updaters can be registered while other threads update nodes */
+static NftResult _test_updater_race(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(2)))
+                return NFT_FAILURE;
+
+        if(!nft_prefs_class_register(p, "racy", NULL, NULL))
+                goto _tur_exit;
+
+        int done = 0;
+        struct BoundedReader r[READERS];
+        int t;
+        for(t = 0; t < READERS; t++)
+        {
+                r[t].p = p;
+                r[t].done = &done;
+                if(pthread_create(&r[t].thread, NULL, _updating_reader,
+                                  &r[t]) != 0)
+                {
+                        NFT_LOG_PERROR("pthread_create()");
+                        while(t-- > 0)
+                                pthread_join(r[t].thread, NULL);
+                        goto _tur_exit;
+                }
+        }
+
+        /* every updater replaces the plans readers may be using (only the
+           first one of a version runs) */
+        bool ok = true;
+        while(__atomic_load_n(&done, __ATOMIC_ACQUIRE) < READERS)
+                ok &= nft_prefs_updater_register(p, _noop_updater, "racy", 1,
+                                                 NULL);
+
+        for(t = 0; t < READERS; t++)
+                pthread_join(r[t].thread, NULL);
+
+        if(!ok || done != READERS)
+        {
+                NFT_LOG(L_ERROR,
+                        "updating nodes while registering updaters failed");
+                goto _tur_exit;
+        }
+
+        res = NFT_SUCCESS;
+
+_tur_exit:
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** many classes can be registered at once & fail as a whole */
+static NftResult _test_table(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(1)))
+                return NFT_FAILURE;
+
+        const NftPrefsUpdaterDesc updaters[] = {
+                {.updater = _noop_updater,.version = 0},
+        };
+        const NftPrefsClassDesc table[] = {
+                {.name = "table.0",.toObj = _stable_to_obj},
+                {.name = "table.1",.updaters = updaters,.updaterCount = 1},
+                {.name = "table.2"},
+        };
+        const NftPrefsClassDesc twice[] = {
+                {.name = "twice"},
+                {.name = "twice"},
+        };
+
+        if(!nft_prefs_class_register_table(p, table, 3))
+                goto _tt_exit;
+
+        int i;
+        for(i = 0; i < 3; i++)
+        {
+                if(nft_prefs_class_get_handle(p, table[i].name) ==
+                   NFT_PREFS_CLASS_ID_INVALID)
+                        goto _tt_exit;
+        }
+
+        NFT_LOG(L_INFO, "==== IGNORE ERROR MESSAGES ====");
+        if(nft_prefs_class_register_table(p, table, 1) ||
+           nft_prefs_class_register_table(p, twice, 2) ||
+           nft_prefs_class_get_handle(p, "twice") !=
+           NFT_PREFS_CLASS_ID_INVALID)
+        {
+                NFT_LOG(L_ERROR, "duplicate classes were registered");
+                goto _tt_exit;
+        }
+        NFT_LOG(L_INFO, "==== END IGNORING ERROR MESSAGES ====");
+
+        res = NFT_SUCCESS;
+
+_tt_exit:
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** updaters registered in any order run sorted by version, once per version,
+    also after the plan of the class changed */
+static NftResult _test_updaters(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        struct UpdateLog log = {.count = 0 }, dup = {.count = 0 };
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(10)))
+                return NFT_FAILURE;
+
+        if(!nft_prefs_class_register(p, "chain", NULL, NULL))
+                goto _tu_exit;
+
+        /* versions 0 & 12 are outside of the chain 1..10, 2 is registered
+           twice (the first one wins) */
+        unsigned int versions[] = { 7, 2, 12, 5, 0, 2 };
+        int i;
+        for(i = 0; i < 6; i++)
+        {
+                if(!nft_prefs_updater_register(p, _logging_updater, "chain",
+                                               versions[i],
+                                               i == 5 ? &dup : &log))
+                        goto _tu_exit;
+        }
+
+        /* 2nd run uses the cached plan, 3rd run must see updater 3 */
+        unsigned int expected[] = { 2, 5, 7, 2, 5, 7, 2, 3, 5, 7 };
+        int run;
+        for(run = 0; run < 3; run++)
+        {
+                if(run == 2 &&
+                   !nft_prefs_updater_register(p, _logging_updater, "chain",
+                                               3, &log))
+                        goto _tu_exit;
+
+                NftPrefsNode *n;
+                if(!(n = nft_prefs_node_from_buffer(p,
+                                                    "<chain version=\"1\"/>",
+                                                    20)))
+                        goto _tu_exit;
+                nft_prefs_node_free(n);
+
+                /* log holds the last run only */
+                int first = run * 3;
+                if(log.count != (run == 2 ? 4 : 3) || dup.count != 0 ||
+                   memcmp(log.versions, &expected[first],
+                          log.count * sizeof(unsigned int)) != 0)
+                {
+                        NFT_LOG(L_ERROR, "updaters ran in wrong order");
+                        goto _tu_exit;
+                }
+                log.count = 0;
+        }
+
+        /* nested nodes are found, subtrees without them are skipped */
+        char docs[][48] = {
+                "<chain version=\"1\"><plain/><chain/></chain>",
+                "<plain version=\"1\"><plain/></plain>",
+        };
+        if(!nft_prefs_class_register(p, "plain", NULL, NULL))
+                goto _tu_exit;
+
+        for(i = 0; i < 2; i++)
+        {
+                NftPrefsNode *n;
+                if(!(n = nft_prefs_node_from_buffer(p, docs[i],
+                                                    strlen(docs[i]))))
+                        goto _tu_exit;
+                nft_prefs_node_free(n);
+
+                if(log.count != (i == 0 ? 8 : 0))
+                {
+                        NFT_LOG(L_ERROR, "%d updaters ran for \"%s\"",
+                                log.count, docs[i]);
+                        goto _tu_exit;
+                }
+                log.count = 0;
+        }
+
+        /* children renamed or added by the updater of their parent are
+           updated, too */
+        char restructure[] = "<parent version=\"1\"><old/></parent>";
+        if(!nft_prefs_class_register(p, "parent", NULL, NULL) ||
+           !nft_prefs_class_register(p, "new", NULL, NULL) ||
+           !nft_prefs_updater_register(p, _restructuring_updater, "parent", 1,
+                                       NULL) ||
+           !nft_prefs_updater_register(p, _logging_updater, "new", 2, &log))
+                goto _tu_exit;
+
+        NftPrefsNode *n;
+        if(!(n = nft_prefs_node_from_buffer(p, restructure,
+                                            strlen(restructure))))
+                goto _tu_exit;
+        nft_prefs_node_free(n);
+
+        if(log.count != 2)
+        {
+                NFT_LOG(L_ERROR, "%d updaters ran for new children",
+                        log.count);
+                goto _tu_exit;
+        }
+
+        res = NFT_SUCCESS;
+
+_tu_exit:
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** top-level subtrees are updated by multiple threads */
+static NftResult _test_parallel(void)
+{
+        NftResult res = NFT_FAILURE;
+        char *buf = NULL;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(2)))
+                return NFT_FAILURE;
+
+        if(!nft_prefs_class_register(p, "setup", NULL, NULL) ||
+           !nft_prefs_class_register(p, "hw", NULL, NULL) ||
+           !nft_prefs_updater_register(p, _marking_updater, "hw", 1, NULL) ||
+           !nft_prefs_updater_set_threadsafe(p, "hw", true) ||
+           !nft_prefs_updater_set_threads(p, 4))
+                goto _tp_exit;
+
+        nft_prefs_class_stats_enable(p, true);
+
+        /* SUBTREES <hw> controllers with one <hw> child each, one run with
+           failing subtrees */
+        size_t size = 64 + SUBTREES * 64;
+        if(!(buf = malloc(size)))
+                goto _tp_exit;
+
+        int run;
+        for(run = 0; run < 2; run++)
+        {
+                size_t len = snprintf(buf, size, "<setup version=\"1\">");
+                int i;
+                for(i = 0; i < SUBTREES; i++)
+                {
+                        bool fail = run == 1 && (i == 5 || i == 20);
+                        len += snprintf(buf + len, size - len,
+                                        "<hw><hw fail=\"%s\"/></hw>",
+                                        fail ? "true" : "false");
+                }
+                len += snprintf(buf + len, size - len, "</setup>");
+
+                NftPrefsNode *root = nft_prefs_node_from_buffer(p, buf, len);
+                if(run == 1)
+                {
+                        if(root)
+                        {
+                                NFT_LOG(L_ERROR, "failed subtree not reported");
+                                nft_prefs_node_free(root);
+                                goto _tp_exit;
+                        }
+                        break;
+                }
+
+                if(!root)
+                        goto _tp_exit;
+
+                /* every <hw> got updated once */
+                uint64_t calls = 0;
+                nft_prefs_class_stats_foreach(p, _hw_stats, &calls);
+
+                int migrated = 0;
+                NftPrefsNode *n;
+                for(n = nft_prefs_node_get_first_child(root); n;
+                    n = nft_prefs_node_get_next(n))
+                {
+                        int v;
+                        NftPrefsNode *c = nft_prefs_node_get_first_child(n);
+                        if(nft_prefs_node_prop_int_get(n, "migrated", &v) &&
+                           c && nft_prefs_node_prop_int_get(c, "migrated", &v))
+                                migrated++;
+                }
+                nft_prefs_node_free(root);
+
+                if(calls != 2 * SUBTREES || migrated != SUBTREES)
+                {
+                        NFT_LOG(L_ERROR, "%d updater calls, %d subtrees updated",
+                                (int) calls, migrated);
+                        goto _tp_exit;
+                }
+        }
+
+        res = NFT_SUCCESS;
+
+_tp_exit:
+        free(buf);
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** write string to file */
+static NftResult _write_file(const char *filename, const char *s)
+{
+        FILE *f;
+        if(!(f = fopen(filename, "w")))
+                return NFT_FAILURE;
+
+        bool ok = fputs(s, f) >= 0;
+        return fclose(f) == 0 && ok;
+}
+
+
+/** updated files are written back & only updated once */
+static NftResult _test_writeback(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        struct UpdateLog log = {.count = 0 };
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(10)))
+                return NFT_FAILURE;
+
+        if(!nft_prefs_class_register(p, "chain", NULL, NULL) ||
+           !nft_prefs_updater_register(p, _logging_updater, "chain", 2, &log) ||
+           !nft_prefs_updater_register(p, _logging_updater, "chain", 5, &log))
+                goto _tw_exit;
+
+        /* updaters per load of each mode: 2nd load uses written file,
+           source changed to version 3 before 3rd load */
+        NftPrefsWriteback modes[] = {
+                NFT_PREFS_WRITEBACK_SIDECAR,
+                NFT_PREFS_WRITEBACK_INPLACE,
+        };
+        int expected[] = { 2, 0, 1 };
+
+        int m;
+        for(m = 0; m < 2; m++)
+        {
+                if(!nft_prefs_node_set_writeback(p, modes[m]) ||
+                   !_write_file(WRITEBACK_FILE, "<chain version=\"1\"/>"))
+                        goto _tw_exit;
+
+                int load;
+                for(load = 0; load < 3; load++)
+                {
+                        if(load == 2 &&
+                           !_write_file(WRITEBACK_FILE,
+                                        "<chain version=\"3\" a=\"b\"/>"))
+                                goto _tw_exit;
+
+                        NftPrefsNode *n;
+                        if(!(n = nft_prefs_node_from_file(p, WRITEBACK_FILE)))
+                                goto _tw_exit;
+
+                        int version = 0;
+                        nft_prefs_node_prop_int_get(n, "version", &version);
+                        nft_prefs_node_free(n);
+
+                        if(log.count != expected[load] || version != 10)
+                        {
+                                NFT_LOG(L_ERROR, "load %d of mode %d: %d "
+                                        "updaters ran, version %d", load,
+                                        modes[m], log.count, version);
+                                goto _tw_exit;
+                        }
+                        log.count = 0;
+                }
+        }
+
+        res = NFT_SUCCESS;
+
+_tw_exit:
+        unlink(WRITEBACK_FILE);
+        unlink(WRITEBACK_FILE ".cache");
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** files written back in place stay behind their symlink & keep their mode */
+static NftResult _test_writeback_symlink(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        NftPrefs *p;
+        if(!(p = nft_prefs_init(10)))
+                return NFT_FAILURE;
+
+        unlink(WRITEBACK_FILE);
+        if(!nft_prefs_class_register(p, "chain", NULL, NULL) ||
+           !nft_prefs_updater_register(p, _noop_updater, "chain", 2, NULL) ||
+           !nft_prefs_node_set_writeback(p, NFT_PREFS_WRITEBACK_INPLACE) ||
+           !_write_file(WRITEBACK_TARGET, "<chain version=\"1\"/>") ||
+           chmod(WRITEBACK_TARGET, 0640) == -1 ||
+           symlink(WRITEBACK_TARGET, WRITEBACK_FILE) == -1)
+                goto _tws_exit;
+
+        NftPrefsNode *n;
+        if(!(n = nft_prefs_node_from_file(p, WRITEBACK_FILE)))
+                goto _tws_exit;
+        nft_prefs_node_free(n);
+
+        /* target must be updated, link & mode untouched */
+        struct stat link, target;
+        int version = 0;
+        if(lstat(WRITEBACK_FILE, &link) == -1 ||
+           stat(WRITEBACK_TARGET, &target) == -1 ||
+           !(n = nft_prefs_node_from_file(p, WRITEBACK_TARGET)))
+                goto _tws_exit;
+        nft_prefs_node_prop_int_get(n, "version", &version);
+        nft_prefs_node_free(n);
+
+        if(!S_ISLNK(link.st_mode) || (target.st_mode & 07777) != 0640 ||
+           version != 10)
+        {
+                NFT_LOG(L_ERROR, "symlink %s, mode %o, version %d",
+                        S_ISLNK(link.st_mode) ? "kept" : "replaced",
+                        (unsigned int) (target.st_mode & 07777), version);
+                goto _tws_exit;
+        }
+
+        res = NFT_SUCCESS;
+
+_tws_exit:
+        unlink(WRITEBACK_FILE);
+        unlink(WRITEBACK_TARGET);
+        nft_prefs_deinit(p);
+        return res;
+}
+
+
+/** one registry can be shared by many contexts & outlive its creator */
+static NftResult _test_shared(void)
+{
+        NftResult res = NFT_FAILURE;
+
+        int blocks = 0;
+        NftAllocator al = {
+                .alloc = _counting_alloc,
+                .realloc = _counting_realloc,
+                .free = _counting_free,
+                .userptr = &blocks,
+        };
+
+        NftPrefs *p, *shared[SHARED];
+        memset(shared, 0, sizeof(shared));
+        if(!(p = nft_prefs_init_with_allocator(0, &al)))
+                return NFT_FAILURE;
+
+        if(!nft_prefs_class_register(p, "table.0", _stable_to_obj, NULL) ||
+           !nft_prefs_updater_register(p, _noop_updater, "table.0", 0, NULL))
+        {
+                nft_prefs_deinit(p);
+                return NFT_FAILURE;
+        }
+
+        NftPrefsRegistry *r;
+        if(!(r = nft_prefs_registry_ref(p)))
+        {
+                nft_prefs_deinit(p);
+                return NFT_FAILURE;
+        }
+
+        /* creator may go away first */
+        nft_prefs_deinit(p);
+
+        int i;
+        for(i = 0; i < SHARED; i++)
+        {
+                if(!(shared[i] = nft_prefs_init_shared(i, r)))
+                        goto _ts_exit;
+        }
+
+        nft_prefs_registry_unref(r);
+        r = NULL;
+
+        for(i = 0; i < SHARED; i++)
+        {
+                NftPrefsNode *n;
+                if(!(n = nft_prefs_node_from_buffer(shared[i],
+                                                    "<table.0/>", 10)))
+                        goto _ts_exit;
+
+                bool found = nft_prefs_obj_from_node(shared[i], n, NULL) == n;
+                nft_prefs_node_free(n);
+                if(!found)
+                {
+                        NFT_LOG(L_ERROR, "shared class not found");
+                        goto _ts_exit;
+                }
+        }
+
+        NFT_LOG(L_INFO, "==== IGNORE ERROR MESSAGES ====");
+        nft_prefs_class_unregister(shared[1], "table.0");
+        if(nft_prefs_class_register(shared[0], "table.1", NULL, NULL) ||
+           nft_prefs_class_get_handle(shared[0], "table.0") ==
+           NFT_PREFS_CLASS_ID_INVALID)
+        {
+                NFT_LOG(L_ERROR, "shared registry was changed");
+                goto _ts_exit;
+        }
+        NFT_LOG(L_INFO, "==== END IGNORING ERROR MESSAGES ====");
+
+        res = NFT_SUCCESS;
+
+_ts_exit:
+        if(r)
+                nft_prefs_registry_unref(r);
+
+        for(i = 0; i < SHARED; i++)
+        {
+                if(shared[i])
+                        nft_prefs_deinit(shared[i]);
+        }
+
+        /* last context must have freed the registry */
+        if(blocks != 0)
+        {
+                NFT_LOG(L_ERROR, "%d blocks of shared registry leaked",
+                        blocks);
+                res = NFT_FAILURE;
+        }
+
+        return res;
+}
+
 
 /** some generic API "stresstests" */
 int main(int argc, char *argv[])
@@ -57,9 +1218,26 @@ int main(int argc, char *argv[])
         if(!NFT_PREFS_CHECK_VERSION)
                 return EXIT_FAILURE;
 
+        if(!_test_registry() || !_test_handle_race() ||
+           !_test_updater_race() || !_test_table() || !_test_node_cache() ||
+           !_test_by_id() || !_test_compact_ids() || !_test_stats() ||
+           !_test_updaters() || !_test_parallel() || !_test_writeback() ||
+           !_test_writeback_symlink() || !_test_shared())
+                return EXIT_FAILURE;
+
         int res = EXIT_FAILURE;
+
+        /* route all context memory through a counting allocator */
+        int blocks = 0;
+        NftAllocator al = {
+                .alloc = _counting_alloc,
+                .realloc = _counting_realloc,
+                .free = _counting_free,
+                .userptr = &blocks,
+        };
+
         NftPrefs *p;
-        if(!(p = nft_prefs_init(0)))
+        if(!(p = nft_prefs_init_with_allocator(0, &al)))
                 goto _deinit;
 
 
@@ -113,10 +1291,94 @@ int main(int argc, char *argv[])
         // ~ nft_prefs_class_unregister(p, cName);
         // ~ }
 
+        if(blocks <= 0)
+        {
+                NFT_LOG(L_ERROR, "custom allocator wasn't used");
+                goto _deinit;
+        }
+
+        /* ids of unregistered classes must become invalid */
+        NftPrefsClassId id;
+        if((id = nft_prefs_class_get_handle(p, "foobar.1")) ==
+           NFT_PREFS_CLASS_ID_INVALID)
+                goto _deinit;
+
+        /* unregister most classes & compact registry */
+        for(i = 0; i < OBJNUM; i++)
+        {
+                if(i % 16 == 0)
+                        continue;
+
+                char cName[64];
+                snprintf(cName, sizeof(cName), "%s.%d", objs[i].name,
+                         objs[i].n);
+                nft_prefs_class_unregister(p, cName);
+        }
+
+        if(!nft_prefs_class_compact(p))
+                goto _deinit;
+
+        /* remaining classes must still be registered */
+        NFT_LOG(L_INFO, "==== IGNORE ERROR MESSAGES ====");
+        if(nft_prefs_obj_to_node_by_id(p, id, NULL, NULL))
+        {
+                NFT_LOG(L_ERROR, "id of unregistered class still valid");
+                goto _deinit;
+        }
+
+        for(i = 0; i < OBJNUM; i += 16)
+        {
+                char cName[64];
+                snprintf(cName, sizeof(cName), "%s.%d", objs[i].name,
+                         objs[i].n);
+                if(nft_prefs_class_register(p, cName, NULL, NULL))
+                {
+                        NFT_LOG(L_ERROR, "class \"%s\" lost by compaction",
+                                cName);
+                        goto _deinit;
+                }
+        }
+
+        /* frozen registry must find the same classes & refuse changes */
+        if(!nft_prefs_freeze(p))
+                goto _deinit;
+
+        for(i = 0; i < OBJNUM; i++)
+        {
+                char cName[64];
+                snprintf(cName, sizeof(cName), "%s.%d", objs[i].name,
+                         objs[i].n);
+                if((nft_prefs_class_get_handle(p, cName) !=
+                    NFT_PREFS_CLASS_ID_INVALID) != (i % 16 == 0))
+                {
+                        NFT_LOG(L_ERROR, "frozen lookup of \"%s\" failed",
+                                cName);
+                        goto _deinit;
+                }
+        }
+
+        if(nft_prefs_class_register(p, "foobar.1", NULL, NULL) ||
+           nft_prefs_updater_register(p, _noop_updater, "foobar.0", 0,
+                                      NULL) ||
+           nft_prefs_class_compact(p))
+        {
+                NFT_LOG(L_ERROR, "frozen registry was changed");
+                goto _deinit;
+        }
+        NFT_LOG(L_INFO, "==== END IGNORING ERROR MESSAGES ====");
+
         res = EXIT_SUCCESS;
 
 _deinit:
         nft_prefs_deinit(p);
 
+        /* everything must have been released through the allocator */
+        if(blocks != 0)
+        {
+                NFT_LOG(L_ERROR, "%d blocks leaked from custom allocator",
+                        blocks);
+                res = EXIT_FAILURE;
+        }
+
         return res;
 }
@@ -43,10 +43,14 @@
 
 
 #include <stdlib.h>
+#include <pthread.h>
 #include <niftylog.h>
 #include <niftyprefs.h>
 
 
+/** amount of slots allocated by _test_linear_alloc() */
+#define LINEAR_SLOTS (1024*1024)
+
 
 
 /** finder function for nft_array_find_slot() */
@@ -79,6 +83,932 @@ static bool _element_validator(void *element, void *userptr)
 }
 
 
+/** allocator that counts calls that (re)allocate memory */
+static void *_calls_alloc(size_t size, void *userptr)
+{
+        (*(int *) userptr)++;
+        return malloc(size);
+}
+
+
+/** allocator that counts calls that (re)allocate memory */
+static void *_calls_realloc(void *ptr, size_t size, void *userptr)
+{
+        (*(int *) userptr)++;
+        return realloc(ptr, size);
+}
+
+
+/** allocator that counts calls that (re)allocate memory */
+static void _calls_free(void *ptr, void *userptr)
+{
+        free(ptr);
+}
+
+
+/** allocate lots of slots, churn them and check that the array grows
+    geometrically (only O(log n) reallocations for n slots) */
+static NftResult _test_linear_alloc(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        int calls = 0;
+        NftAllocator al = {
+                .alloc = _calls_alloc,
+                .realloc = _calls_realloc,
+                .free = _calls_free,
+                .userptr = &calls,
+        };
+
+        NftArray a;
+        nft_array_init(&a, sizeof(int));
+        nft_array_set_name(&a, "TestArray02");
+        if(!nft_array_set_allocator(&a, &al))
+                goto _tla_exit;
+
+        /* fill array */
+        NftArraySlot i;
+        for(i = 0; i < LINEAR_SLOTS; i++)
+        {
+                NftArraySlot s;
+                if(!(nft_array_slot_alloc(&a, &s)))
+                {
+                        NFT_LOG(L_ERROR, "Failed to allocate new slot");
+                        goto _tla_exit;
+                }
+
+                /* fresh array should hand out slots in order */
+                if(s != i)
+                {
+                        NFT_LOG(L_ERROR, "Got slot %d, expected %d", s, i);
+                        goto _tla_exit;
+                }
+        }
+
+        /* every growth reallocates a handful of buffers at most */
+        int log2 = 0;
+        for(i = LINEAR_SLOTS; i > 1; i /= 2)
+                log2++;
+
+        NFT_LOG(L_INFO, "allocated %d slots with %d allocator calls",
+                LINEAR_SLOTS, calls);
+
+        if(calls > 4 * log2)
+        {
+                NFT_LOG(L_ERROR, "%d allocator calls for %d slots, "
+                        "array doesn't grow geometrically", calls,
+                        LINEAR_SLOTS);
+                goto _tla_exit;
+        }
+
+        /* free every second slot */
+        for(i = 0; i < LINEAR_SLOTS; i += 2)
+                nft_array_slot_free(&a, i);
+
+        if(nft_array_get_elementcount(&a) != LINEAR_SLOTS / 2)
+        {
+                NFT_LOG(L_ERROR, "wrong elementcount after freeing slots");
+                goto _tla_exit;
+        }
+
+        /* allocating again must reuse the freed slots without growing */
+        size_t arraysize = a.arraysize;
+        for(i = 0; i < LINEAR_SLOTS / 2; i++)
+        {
+                NftArraySlot s;
+                if(!(nft_array_slot_alloc(&a, &s)))
+                {
+                        NFT_LOG(L_ERROR, "Failed to allocate new slot");
+                        goto _tla_exit;
+                }
+
+                if(s % 2 != 0 || s >= LINEAR_SLOTS)
+                {
+                        NFT_LOG(L_ERROR, "slot %d wasn't reused", s);
+                        goto _tla_exit;
+                }
+        }
+
+        if(a.arraysize != arraysize ||
+           nft_array_get_elementcount(&a) != LINEAR_SLOTS)
+        {
+                NFT_LOG(L_ERROR, "array grew although free slots were left");
+                goto _tla_exit;
+        }
+
+        r = NFT_SUCCESS;
+
+_tla_exit:
+        nft_array_deinit(&a);
+        return r;
+}
+
+
+/** reserve space in advance and give it back afterwards */
+static NftResult _test_reserve(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        NftArray a;
+        nft_array_init(&a, sizeof(int));
+        nft_array_set_name(&a, "TestArray03");
+
+        if(!nft_array_reserve(&a, 1000) || a.arraysize != 1000)
+        {
+                NFT_LOG(L_ERROR, "nft_array_reserve() failed");
+                goto _tr_exit;
+        }
+
+        /* filling reserved space must not grow the array */
+        NftArraySlot i;
+        for(i = 0; i < 1000; i++)
+        {
+                NftArraySlot s;
+                if(!(nft_array_slot_alloc(&a, &s)))
+                        goto _tr_exit;
+
+                *((int *) nft_array_get_element(&a, s)) = (int) s;
+        }
+
+        if(a.arraysize != 1000)
+        {
+                NFT_LOG(L_ERROR, "array grew although space was reserved");
+                goto _tr_exit;
+        }
+
+        /* free upper slots & a hole, then shrink */
+        for(i = 100; i < 1000; i++)
+                nft_array_slot_free(&a, i);
+        nft_array_slot_free(&a, 50);
+
+        if(!nft_array_shrink_to_fit(&a) || a.arraysize != 100)
+        {
+                NFT_LOG(L_ERROR, "nft_array_shrink_to_fit() failed");
+                goto _tr_exit;
+        }
+
+        /* remaining elements must be untouched */
+        for(i = 0; i < 100; i++)
+        {
+                if(i == 50)
+                        continue;
+
+                int *e;
+                if(!(e = nft_array_get_element(&a, i)) || *e != (int) i)
+                {
+                        NFT_LOG(L_ERROR, "element %d lost after shrinking", i);
+                        goto _tr_exit;
+                }
+        }
+
+        /* hole must be reused first */
+        NftArraySlot s;
+        if(!nft_array_slot_alloc(&a, &s) || s != 50)
+        {
+                NFT_LOG(L_ERROR, "free slot wasn't reused after shrinking");
+                goto _tr_exit;
+        }
+
+        r = NFT_SUCCESS;
+
+_tr_exit:
+        nft_array_deinit(&a);
+        return r;
+}
+
+
+/** elements of stable arrays must never move */
+static NftResult _test_stable(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        NftArray a;
+        nft_array_init_stable(&a, sizeof(int));
+        nft_array_set_name(&a, "TestArray04");
+
+        /* remember first element */
+        NftArraySlot first;
+        int *e;
+        if(!nft_array_slot_alloc(&a, &first) ||
+           !(e = nft_array_get_element(&a, first)))
+                goto _ts_exit;
+        *e = 42;
+
+        /* grow array a lot */
+        NftArraySlot i;
+        for(i = 0; i < 10000; i++)
+        {
+                NftArraySlot s;
+                if(!(nft_array_slot_alloc(&a, &s)))
+                        goto _ts_exit;
+        }
+
+        if(nft_array_get_element(&a, first) != e || *e != 42)
+        {
+                NFT_LOG(L_ERROR, "element moved while array grew");
+                goto _ts_exit;
+        }
+
+        /* shrink array again */
+        for(i = 1; i <= 10000; i++)
+                nft_array_slot_free(&a, i);
+
+        if(!nft_array_shrink_to_fit(&a) || a.arraysize != NFT_ARRAY_CHUNK_SIZE)
+        {
+                NFT_LOG(L_ERROR, "stable array didn't shrink");
+                goto _ts_exit;
+        }
+
+        if(nft_array_get_element(&a, first) != e || *e != 42)
+        {
+                NFT_LOG(L_ERROR, "element moved while array shrunk");
+                goto _ts_exit;
+        }
+
+        r = NFT_SUCCESS;
+
+_ts_exit:
+        nft_array_deinit(&a);
+        return r;
+}
+
+
+/** counts elements for nft_array_foreach_element() */
+static bool _element_counter(void *element, void *userptr)
+{
+        size_t *count = userptr;
+        (*count)++;
+        return true;
+}
+
+
+/** walk a mostly empty array */
+static NftResult _test_sparse(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        NftArray a;
+        nft_array_init(&a, sizeof(int));
+        nft_array_set_name(&a, "TestArray05");
+
+        /* fill array */
+        NftArraySlot i;
+        for(i = 0; i < 100000; i++)
+        {
+                NftArraySlot s;
+                if(!(nft_array_slot_alloc(&a, &s)))
+                        goto _tsp_exit;
+
+                *((int *) nft_array_get_element(&a, s)) = (int) s;
+        }
+
+        /* only leave a few elements */
+        for(i = 0; i < 100000; i++)
+        {
+                if(i != 3 && i != 64 && i != 99999)
+                        nft_array_slot_free(&a, i);
+        }
+
+        size_t count = 0;
+        if(!nft_array_foreach_element(&a, _element_counter, &count) ||
+           count != 3)
+        {
+                NFT_LOG(L_ERROR, "visited %d elements, expected 3", count);
+                goto _tsp_exit;
+        }
+
+        /* same with inline iterator */
+        NftArraySlot slot;
+        int *e;
+        count = 0;
+        NFT_ARRAY_FOREACH(&a, slot, e)
+        {
+                if(*e != (int) slot)
+                {
+                        NFT_LOG(L_ERROR, "iterator returned wrong element");
+                        goto _tsp_exit;
+                }
+                count++;
+        }
+
+        if(count != 3)
+        {
+                NFT_LOG(L_ERROR, "iterated %d elements, expected 3", count);
+                goto _tsp_exit;
+        }
+
+        int last = 99999;
+        if(!nft_array_find_slot(&a, &slot, _finder, &last, NULL) ||
+           slot != 99999)
+        {
+                NFT_LOG(L_ERROR, "last element not found in sparse array");
+                goto _tsp_exit;
+        }
+
+        r = NFT_SUCCESS;
+
+_tsp_exit:
+        nft_array_deinit(&a);
+        return r;
+}
+
+
+/** element used to test key index */
+struct Named
+{
+        char name[32];
+        int value;
+};
+
+
+/** NftArrayKeyFunc for struct Named */
+static const void *_named_key(void *element)
+{
+        return ((struct Named *) element)->name;
+}
+
+
+/** find elements by key */
+static NftResult _test_index(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        NftArray a;
+        nft_array_init(&a, sizeof(struct Named));
+        nft_array_set_name(&a, "TestArray06");
+
+        if(!nft_array_index_enable(&a, _named_key, nft_array_hash_string,
+                                   nft_array_key_equal_string))
+                goto _ti_exit;
+
+        /* fill array */
+        int i;
+        for(i = 0; i < 10000; i++)
+        {
+                NftArraySlot s;
+                if(!(nft_array_slot_alloc(&a, &s)))
+                        goto _ti_exit;
+
+                struct Named *n = nft_array_get_element(&a, s);
+                snprintf(n->name, sizeof(n->name), "element%d", i);
+                n->value = i;
+        }
+
+        /* remove every third element */
+        for(i = 0; i < 10000; i += 3)
+        {
+                char name[32];
+                NftArraySlot s;
+                snprintf(name, sizeof(name), "element%d", i);
+                if(!nft_array_find_by_key(&a, &s, name))
+                {
+                        NFT_LOG(L_ERROR, "\"%s\" not found", name);
+                        goto _ti_exit;
+                }
+                nft_array_slot_free(&a, s);
+        }
+
+        /* check all elements */
+        for(i = 0; i < 10000; i++)
+        {
+                char name[32];
+                NftArraySlot s;
+                snprintf(name, sizeof(name), "element%d", i);
+                bool found = nft_array_find_by_key(&a, &s, name);
+
+                if(found != (i % 3 != 0))
+                {
+                        NFT_LOG(L_ERROR, "\"%s\" %s", name,
+                                found ? "found after free" : "not found");
+                        goto _ti_exit;
+                }
+
+                if(found &&
+                   ((struct Named *) nft_array_get_element(&a, s))->value != i)
+                {
+                        NFT_LOG(L_ERROR, "found wrong element for \"%s\"",
+                                name);
+                        goto _ti_exit;
+                }
+        }
+
+        r = NFT_SUCCESS;
+
+_ti_exit:
+        nft_array_deinit(&a);
+        return r;
+}
+
+
+/** allocate and release lots of slots at once */
+static NftResult _test_bulk(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        NftArray a;
+        nft_array_init_stable(&a, sizeof(struct Named));
+        nft_array_set_name(&a, "TestArray07");
+
+        if(!nft_array_index_enable(&a, _named_key, nft_array_hash_string,
+                                   nft_array_key_equal_string))
+                goto _tb_exit;
+
+        /* some single slots with a hole */
+        NftArraySlot single;
+        int i;
+        for(i = 0; i < 10; i++)
+        {
+                if(!(nft_array_slot_alloc(&a, &single)))
+                        goto _tb_exit;
+
+                struct Named *n = nft_array_get_element(&a, single);
+                snprintf(n->name, sizeof(n->name), "single%d", i);
+        }
+        nft_array_slot_free(&a, 3);
+
+        /* allocate run of slots */
+        NftArraySlot slots[1000];
+        if(!nft_array_slot_alloc_n(&a, 1000, slots))
+                goto _tb_exit;
+
+        for(i = 0; i < 1000; i++)
+        {
+                struct Named *n;
+                if(slots[i] != (NftArraySlot) (10 + i) ||
+                   !(n = nft_array_get_element(&a, slots[i])) || n->value != 0)
+                {
+                        NFT_LOG(L_ERROR, "bad slot %d from bulk allocation",
+                                slots[i]);
+                        goto _tb_exit;
+                }
+
+                snprintf(n->name, sizeof(n->name), "bulk%d", i);
+                n->value = i;
+        }
+
+        NftArraySlot s;
+        if(nft_array_get_elementcount(&a) != 1009 ||
+           !nft_array_find_by_key(&a, &s, "bulk999") || s != 1009 ||
+           !nft_array_find_by_key(&a, &s, "single9") || s != 9)
+        {
+                NFT_LOG(L_ERROR, "bulk allocated elements not found");
+                goto _tb_exit;
+        }
+
+        /* free pending slots before their keys got indexed */
+        NftArraySlot more[100];
+        if(!nft_array_slot_alloc_n(&a, 100, more))
+                goto _tb_exit;
+
+        for(i = 0; i < 100; i++)
+        {
+                struct Named *n = nft_array_get_element(&a, more[i]);
+                snprintf(n->name, sizeof(n->name), "more%d", i);
+        }
+
+        for(i = 0; i < 100; i += 3)
+                nft_array_slot_free(&a, more[i]);
+
+        for(i = 0; i < 100; i++)
+        {
+                char name[32];
+                snprintf(name, sizeof(name), "more%d", i);
+                if(nft_array_find_by_key(&a, &s, name) != (i % 3 != 0) ||
+                   (i % 3 && s != more[i]))
+                {
+                        NFT_LOG(L_ERROR,
+                                "\"%s\" wrong after freeing pending slots",
+                                name);
+                        goto _tb_exit;
+                }
+        }
+
+        /* cleared elements of freed slots must not be indexed */
+        if(nft_array_find_by_key(&a, &s, ""))
+        {
+                NFT_LOG(L_ERROR, "freed slot %d still indexed", s);
+                goto _tb_exit;
+        }
+
+        /* release everything */
+        nft_array_clear(&a);
+
+        if(nft_array_get_elementcount(&a) != 0 ||
+           nft_array_iter_begin(&a) != NFT_ARRAY_SLOT_INVALID ||
+           nft_array_find_by_key(&a, &s, "bulk0"))
+        {
+                NFT_LOG(L_ERROR, "array not empty after nft_array_clear()");
+                goto _tb_exit;
+        }
+
+        /* start over */
+        if(!nft_array_slot_alloc(&a, &s) || s != 0 ||
+           ((struct Named *) nft_array_get_element(&a, s))->name[0] != '\0')
+        {
+                NFT_LOG(L_ERROR, "cleared array not reusable");
+                goto _tb_exit;
+        }
+
+        r = NFT_SUCCESS;
+
+_tb_exit:
+        nft_array_deinit(&a);
+        return r;
+}
+
+
+/** stale handles must be detected */
+static NftResult _test_handles(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        NftArray a;
+        nft_array_init(&a, sizeof(int));
+        nft_array_set_name(&a, "TestArray08");
+
+        NftArraySlot s;
+        int i;
+        for(i = 0; i < 3; i++)
+        {
+                if(!nft_array_slot_alloc(&a, &s))
+                        goto _th_exit;
+        }
+
+        NftArrayHandle h;
+        if((h = nft_array_slot_get_handle(&a, 1)) == NFT_ARRAY_HANDLE_INVALID ||
+           !nft_array_handle_is_valid(&a, h) ||
+           nft_array_handle_get_element(&a, h) != nft_array_get_element(&a, 1) ||
+           nft_array_handle_get_element_unchecked(&a, h) !=
+           nft_array_get_element(&a, 1))
+        {
+                NFT_LOG(L_ERROR, "handle of allocated slot not valid");
+                goto _th_exit;
+        }
+
+        /* free & reuse slot */
+        nft_array_slot_free(&a, 1);
+        if(!nft_array_slot_alloc(&a, &s) || s != 1)
+                goto _th_exit;
+
+        NftArrayHandle n = nft_array_slot_get_handle(&a, 1);
+        if(nft_array_handle_is_valid(&a, h) ||
+           nft_array_handle_get_element(&a, h) ||
+           !nft_array_handle_is_valid(&a, n) || n == h)
+        {
+                NFT_LOG(L_ERROR, "stale handle not detected");
+                goto _th_exit;
+        }
+
+        /* handles stay stale when the slot vanishes & comes back */
+        NftArrayHandle t;
+        if((t = nft_array_slot_get_handle(&a, 2)) == NFT_ARRAY_HANDLE_INVALID)
+                goto _th_exit;
+
+        nft_array_slot_free(&a, 2);
+        if(!nft_array_shrink_to_fit(&a) || !nft_array_slot_alloc(&a, &s) ||
+           s != 2 || nft_array_handle_is_valid(&a, t) ||
+           nft_array_handle_get_element(&a, t))
+        {
+                NFT_LOG(L_ERROR, "stale handle valid after shrinking");
+                goto _th_exit;
+        }
+
+        /* clearing invalidates all handles */
+        nft_array_clear(&a);
+        if(nft_array_handle_is_valid(&a, n) ||
+           nft_array_handle_is_valid(&a, NFT_ARRAY_HANDLE_INVALID))
+        {
+                NFT_LOG(L_ERROR, "handle valid after nft_array_clear()");
+                goto _th_exit;
+        }
+
+        r = NFT_SUCCESS;
+
+_th_exit:
+        nft_array_deinit(&a);
+        return r;
+}
+
+
+/** allocator that counts live blocks */
+static void *_counting_alloc(size_t size, void *userptr)
+{
+        (*(int *) userptr)++;
+        return malloc(size);
+}
+
+
+/** allocator that counts live blocks */
+static void *_counting_realloc(void *ptr, size_t size, void *userptr)
+{
+        if(!ptr)
+                (*(int *) userptr)++;
+        return realloc(ptr, size);
+}
+
+
+/** allocator that counts live blocks */
+static void _counting_free(void *ptr, void *userptr)
+{
+        (*(int *) userptr)--;
+        free(ptr);
+}
+
+
+/** all array memory must come from a custom allocator */
+static NftResult _test_allocator(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        int blocks = 0;
+        NftAllocator al = {
+                .alloc = _counting_alloc,
+                .realloc = _counting_realloc,
+                .free = _counting_free,
+                .userptr = &blocks,
+        };
+
+        NftArray a;
+        nft_array_init_stable(&a, sizeof(struct Named));
+        nft_array_set_name(&a, "TestArray09");
+        if(!nft_array_set_allocator(&a, &al))
+                goto _ta_exit;
+
+        int i;
+        for(i = 0; i < 200; i++)
+        {
+                NftArraySlot s;
+                if(!nft_array_slot_alloc(&a, &s))
+                        goto _ta_exit;
+                struct Named *n = nft_array_get_element(&a, s);
+                snprintf(n->name, sizeof(n->name), "n%d", i);
+        }
+
+        if(!nft_array_index_enable(&a, _named_key, nft_array_hash_string,
+                                   nft_array_key_equal_string))
+                goto _ta_exit;
+
+        if(blocks <= 0)
+        {
+                NFT_LOG(L_ERROR, "custom allocator wasn't used");
+                goto _ta_exit;
+        }
+
+        /* changing the allocator of a populated array must fail */
+        NFT_LOG(L_INFO, "==== IGNORE ERROR MESSAGES ====");
+        if(nft_array_set_allocator(&a, NULL))
+        {
+                NFT_LOG(L_ERROR, "allocator changed after allocation");
+                goto _ta_exit;
+        }
+        NFT_LOG(L_INFO, "==== END IGNORING ERROR MESSAGES ====");
+
+        r = NFT_SUCCESS;
+
+_ta_exit:
+        nft_array_deinit(&a);
+
+        if(blocks != 0)
+        {
+                NFT_LOG(L_ERROR, "%d blocks leaked from custom allocator",
+                        blocks);
+                r = NFT_FAILURE;
+        }
+
+        return r;
+}
+
+
+/** remap callback that checks elements moved downwards */
+static void _remap_checker(void *element, NftArraySlot from, NftArraySlot to,
+                           void *userptr)
+{
+        if(to < from)
+                (*(size_t *) userptr)++;
+}
+
+
+/** compaction moves elements to the front & releases memory */
+static NftResult _test_compact(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        NftArray a;
+        nft_array_init_stable(&a, sizeof(struct Named));
+        nft_array_set_name(&a, "TestArray11");
+        if(!nft_array_index_enable(&a, _named_key, nft_array_hash_string,
+                                   nft_array_key_equal_string))
+                goto _tc_exit;
+
+        /* keep every 10th element */
+        NftArraySlot s;
+        size_t i;
+        for(i = 0; i < 1000; i++)
+        {
+                if(!nft_array_slot_alloc(&a, &s))
+                        goto _tc_exit;
+                struct Named *n = nft_array_get_element(&a, s);
+                snprintf(n->name, sizeof(n->name), "element%d", (int) i);
+                n->value = i;
+        }
+        NftArrayHandle h = nft_array_slot_get_handle(&a, 990);
+        for(i = 0; i < 1000; i++)
+        {
+                if(i % 10)
+                        nft_array_slot_free(&a, i);
+        }
+
+        size_t moved = 0;
+        if(!nft_array_compact(&a, _remap_checker, &moved))
+                goto _tc_exit;
+
+        if(moved != 90 || a.used != 100 || a.arraysize >= 1000 ||
+           nft_array_get_elementcount(&a) != 100 ||
+           nft_array_handle_is_valid(&a, h))
+        {
+                NFT_LOG(L_ERROR, "array not compacted (%d elements moved)",
+                        moved);
+                goto _tc_exit;
+        }
+
+        /* index must follow elements */
+        for(i = 0; i < 1000; i += 10)
+        {
+                char name[32];
+                snprintf(name, sizeof(name), "element%d", (int) i);
+                struct Named *n;
+                if(!nft_array_find_by_key(&a, &s, name) || s >= 100 ||
+                   !(n = nft_array_get_element(&a, s)) || n->value != (int) i)
+                {
+                        NFT_LOG(L_ERROR, "\"%s\" lost during compaction",
+                                name);
+                        goto _tc_exit;
+                }
+        }
+
+        /* array keeps working */
+        if(!nft_array_slot_alloc(&a, &s) || s != 100)
+                goto _tc_exit;
+
+        r = NFT_SUCCESS;
+
+_tc_exit:
+        nft_array_deinit(&a);
+        return r;
+}
+
+
+/** amount of threads in concurrent test */
+#define THREADS 4
+/** amount of slots each thread holds at once */
+#define THREAD_SLOTS 256
+/** amount of alloc/free rounds of each thread */
+#define THREAD_ROUNDS 500
+
+/** element of concurrent test */
+struct Owned
+{
+        size_t owner;
+        size_t serial;
+};
+
+/** one thread of concurrent test */
+struct Worker
+{
+        pthread_t thread;
+        NftArray *a;
+        size_t id;
+        bool ok;
+};
+
+/** allocate, check & free slots in a concurrent array */
+static void *_concurrent_worker(void *userptr)
+{
+        struct Worker *w = userptr;
+        NftArraySlot slots[THREAD_SLOTS];
+
+        int round;
+        for(round = 0; round < THREAD_ROUNDS; round++)
+        {
+                size_t i;
+                for(i = 0; i < THREAD_SLOTS; i++)
+                {
+                        if(!nft_array_slot_alloc(w->a, &slots[i]))
+                                return NULL;
+
+                        /* slot must be fresh & only be owned by us */
+                        struct Owned *o = nft_array_get_element(w->a, slots[i]);
+                        if(!o || o->owner != 0)
+                                return NULL;
+
+                        o->owner = w->id;
+                        o->serial = i;
+                }
+
+                for(i = 0; i < THREAD_SLOTS; i++)
+                {
+                        struct Owned *o = nft_array_get_element(w->a, slots[i]);
+                        if(!o || o->owner != w->id || o->serial != i)
+                                return NULL;
+
+                        nft_array_slot_free(w->a, slots[i]);
+                }
+        }
+
+        w->ok = true;
+        return NULL;
+}
+
+/** walk a concurrent array while other threads modify it */
+static void *_concurrent_reader(void *userptr)
+{
+        struct Worker *w = userptr;
+
+        int round;
+        for(round = 0; round < THREAD_ROUNDS; round++)
+        {
+                size_t count = 0;
+                NftArraySlot s;
+                for(s = nft_array_iter_begin(w->a);
+                    s != NFT_ARRAY_SLOT_INVALID;
+                    s = nft_array_iter_next(w->a, s))
+                        count++;
+
+                if(count > THREADS * THREAD_SLOTS)
+                        return NULL;
+        }
+
+        w->ok = true;
+        return NULL;
+}
+
+
+/** slots of a concurrent array can be allocated by many threads at once */
+static NftResult _test_concurrent(void)
+{
+        NftResult r = NFT_FAILURE;
+
+        NftArray a;
+        if(!nft_array_init_concurrent(&a, sizeof(struct Owned),
+                                      THREADS * THREAD_SLOTS))
+                return NFT_FAILURE;
+        nft_array_set_name(&a, "TestArray10");
+
+        struct Worker w[THREADS + 1];
+        size_t t;
+        for(t = 0; t <= THREADS; t++)
+        {
+                w[t].a = &a;
+                w[t].id = t + 1;
+                w[t].ok = false;
+                if(pthread_create(&w[t].thread, NULL,
+                                  t < THREADS ? _concurrent_worker :
+                                  _concurrent_reader, &w[t]) != 0)
+                {
+                        NFT_LOG_PERROR("pthread_create()");
+                        while(t-- > 0)
+                                pthread_join(w[t].thread, NULL);
+                        goto _tc_exit;
+                }
+        }
+
+        bool ok = true;
+        for(t = 0; t <= THREADS; t++)
+        {
+                pthread_join(w[t].thread, NULL);
+                ok &= w[t].ok;
+        }
+
+        if(!ok || nft_array_get_elementcount(&a) != 0)
+        {
+                NFT_LOG(L_ERROR, "concurrent allocation failed");
+                goto _tc_exit;
+        }
+
+        /* capacity is fixed */
+        NftArraySlot s;
+        for(t = 0; t < THREADS * THREAD_SLOTS; t++)
+        {
+                if(!nft_array_slot_alloc(&a, &s))
+                        goto _tc_exit;
+        }
+
+        NFT_LOG(L_INFO, "==== IGNORE ERROR MESSAGES ====");
+        if(nft_array_slot_alloc(&a, &s) || nft_array_shrink_to_fit(&a))
+        {
+                NFT_LOG(L_ERROR, "concurrent array grew or shrunk");
+                goto _tc_exit;
+        }
+        NFT_LOG(L_INFO, "==== END IGNORING ERROR MESSAGES ====");
+
+        r = NFT_SUCCESS;
+
+_tc_exit:
+        nft_array_deinit(&a);
+        return r;
+}
+
+
 /** some testing for NftArray */
 int main(int argc, char *argv[])
 {
@@ -171,6 +1101,46 @@ int main(int argc, char *argv[])
                 goto _deinit;
         }
 
+        /* allocation must be independent of array size */
+        if(!_test_linear_alloc())
+                goto _deinit;
+
+        /* reserving & shrinking */
+        if(!_test_reserve())
+                goto _deinit;
+
+        /* stable element addresses */
+        if(!_test_stable())
+                goto _deinit;
+
+        /* iterating sparse arrays */
+        if(!_test_sparse())
+                goto _deinit;
+
+        /* key index */
+        if(!_test_index())
+                goto _deinit;
+
+        /* bulk allocation */
+        if(!_test_bulk())
+                goto _deinit;
+
+        /* generation-counted handles */
+        if(!_test_handles())
+                goto _deinit;
+
+        /* custom allocator */
+        if(!_test_allocator())
+                goto _deinit;
+
+        /* compaction */
+        if(!_test_compact())
+                goto _deinit;
+
+        /* lock-free allocation from multiple threads */
+        if(!_test_concurrent())
+                goto _deinit;
+
         /* all fine */
         r = EXIT_SUCCESS;
 
@@ -355,6 +355,53 @@ int main(int argc, char *argv[])
 	}
 
 
+	/* same update through frozen registry */
+	if(!nft_prefs_freeze(prefs))
+	{
+			NFT_LOG(L_ERROR, "failed to freeze prefs context");
+			goto _deinit;
+	}
+
+	if(!(node = nft_prefs_node_from_file(prefs, "test-prefs.xml")))
+	{
+			NFT_LOG(L_ERROR,
+					"failed to parse prefs file \"test-prefs.xml\"");
+			goto _deinit;
+	}
+
+	/* every person must have been updated */
+	const char *users[PEOPLECOUNT] = { "bob", "alice" };
+	NftPrefsNode *child;
+	for(n = 0, child = nft_prefs_node_get_first_child(node);
+	    child; n++, child = nft_prefs_node_get_next(child))
+	{
+			char *user = nft_prefs_node_prop_string_get(child, "email_user");
+			char *host = nft_prefs_node_prop_string_get(child, "email_host");
+			bool match = n < PEOPLECOUNT && user && host &&
+					strcmp(user, users[n]) == 0 &&
+					strcmp(host, "example.com") == 0;
+			nft_prefs_free(user);
+			nft_prefs_free(host);
+
+			if(!match)
+			{
+					NFT_LOG(L_ERROR,
+							"Input updated through frozen registry doesn't match output!");
+					nft_prefs_node_free(node);
+					goto _deinit;
+			}
+	}
+
+	nft_prefs_node_free(node);
+
+	if(n != PEOPLECOUNT)
+	{
+			NFT_LOG(L_ERROR, "%d persons updated through frozen registry",
+			        (int) n);
+			goto _deinit;
+	}
+
+
 	/* all good */
 	result = EXIT_SUCCESS;
 